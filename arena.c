@@ -0,0 +1,136 @@
+/*
+ * An arena hands out memory for the allocations that only last as long as
+ * one input, and takes all of it back at once when the input is done, so
+ * formatting many inputs one after another does not malloc and free the
+ * same sizes over and over.
+ *
+ * Memory comes from blocks taken from malloc, used from the start up.  When
+ * the block in use is full another one at least twice its size is added.
+ * A reset makes the block in use empty again, which is all it does once the
+ * arena has one block big enough for the largest input.  Until then, a
+ * reset after an input that needed more than one block replaces them with a
+ * single block of their total size, so the next such input fits in it.
+ * The memory held is thus bounded by what the largest input needed.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN	16		/* enough for anything allocated */
+#define ARENA_MIN	(64 * 1024)	/* the smallest block */
+
+#define ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define MEM(b)		((char *)(b) + ROUND(sizeof(struct arena_block)))
+
+struct arena_block {
+    struct arena_block *prev;	/* filled before this one */
+    size_t      size;		/* bytes after the header */
+    size_t      used;
+};
+
+static struct arena_block *
+block_new(struct arena *a, size_t size)
+{
+    struct arena_block *b;
+
+    if (size > SIZE_MAX - ROUND(sizeof *b)) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+    if ((b = malloc(ROUND(sizeof *b) + size)) == NULL)
+	return (NULL);
+    b->prev = a->b;
+    b->size = size;
+    b->used = 0;
+    a->b = b;
+    a->total += size;
+    return (b);
+}
+
+/*
+ * Return n bytes, aligned for any type, or NULL if out of memory.
+ */
+void *
+arena_alloc(struct arena *a, size_t n)
+{
+    struct arena_block *b = a->b;
+    size_t size;
+    void *p;
+
+    if (n > SIZE_MAX - ARENA_ALIGN) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+    n = ROUND(n);
+    if (b == NULL || b->size - b->used < n) {
+	size = b != NULL && b->size <= SIZE_MAX / 2 ? b->size * 2 : ARENA_MIN;
+	if (size < n)
+	    size = n;
+	if ((b = block_new(a, size)) == NULL)
+	    return (NULL);
+    }
+    p = MEM(b) + b->used;
+    b->used += n;
+    return (p);
+}
+
+/*
+ * Make p, allocated with old bytes, hold n bytes instead, as realloc does.
+ * The last allocation grows where it is if its block has room; anything
+ * else is copied, and the old space stays used until the reset.
+ */
+void *
+arena_grow(struct arena *a, void *p, size_t old, size_t n)
+{
+    struct arena_block *b = a->b;
+    void *np;
+
+    if (p == NULL)
+	return (arena_alloc(a, n));
+    if (n <= old)
+	return (p);
+    if (b != NULL && (char *)p + ROUND(old) == MEM(b) + b->used &&
+	n <= SIZE_MAX - ARENA_ALIGN &&
+	ROUND(n) - ROUND(old) <= b->size - b->used) {
+	b->used += ROUND(n) - ROUND(old);
+	return (p);
+    }
+    if ((np = arena_alloc(a, n)) == NULL)
+	return (NULL);
+    memcpy(np, p, old < n ? old : n);
+    return (np);
+}
+
+/*
+ * Give back everything allocated since the last reset.
+ */
+void
+arena_reset(struct arena *a)
+{
+    size_t total = a->total;
+
+    if (a->b == NULL)
+	return;
+    if (a->b->prev == NULL) {
+	a->b->used = 0;
+	return;
+    }
+    arena_free(a);
+    block_new(a, total);	/* or start over small if it fails */
+}
+
+void
+arena_free(struct arena *a)
+{
+    struct arena_block *b, *prev;
+
+    for (b = a->b; b != NULL; b = prev) {
+	prev = b->prev;
+	free(b);
+    }
+    a->b = NULL;
+    a->total = 0;
+}
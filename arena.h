@@ -0,0 +1,22 @@
+/*
+ * Memory that is all given back at once.  See arena.c.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *b;	/* the block in use, after those filled */
+    size_t      total;		/* the size of all the blocks */
+};
+
+void *arena_alloc(struct arena *, size_t);
+void *arena_grow(struct arena *, void *, size_t, size_t);
+void arena_reset(struct arena *);
+void arena_free(struct arena *);
+
+#endif /* ARENA_H */
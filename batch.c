@@ -0,0 +1,401 @@
+/*
+ * Format many files at once.  Each file is independent of the others, so
+ * a pool of threads takes them from the list in turn, each thread with a
+ * context of its own.  A result is written to a temporary file next to its
+ * destination and renamed over it, so an interrupted run never leaves a
+ * half written file behind.  In place, a symbolic link is followed, and
+ * it is the file it points to that is replaced.  A file with more than one
+ * link is refused, as the rename would leave the other links with the old
+ * contents.
+ *
+ * With a cache (see cache.c), a file is looked up by its contents first,
+ * and formatted only on a miss.  A file that is already formatted is then
+ * not written back at all when formatting in place.
+ *
+ * When there are fewer files than threads, the threads left over go to
+ * formatting pieces of each file in parallel (see parallel.c).
+ *
+ * What a file is read into is taken from an arena of the thread's, reset
+ * after each file, so it is only allocated again for a larger file.
+ *
+ * A path given with an output directory is put under it as it is, so one
+ * that is absolute or climbs out with ".." is refused.  Failing to read or
+ * write a file is reported for that file alone, and the others go on.
+ *
+ * In check mode nothing is written; each file is only compared with what
+ * formatting it would give, and the first line that differs is reported.
+ * In diff mode a unified diff of each file that would change is printed
+ * too, in the order of the files.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "indent.h"
+#include "arena.h"
+#include "cache.h"
+#include "diff.h"
+
+struct batch {
+    char      **paths;
+    size_t      npaths;
+    const char *outdir;		/* NULL to replace the files in place */
+    struct cache *cache;	/* NULL for none */
+    int         mode;		/* 0, INDENT_CHECK or INDENT_DIFF */
+    int         split;		/* threads for each file */
+    int        *status;		/* per file: 0, 1 if diagnosed, or -errno */
+    int        *line;		/* per file when checking or diffing: the
+				 * first line that differs, or 0 */
+    char      **diff;		/* per file when diffing: the diff, or NULL */
+    size_t     *difflen;
+    size_t      next;		/* next file to hand out */
+    pthread_mutex_t lock;
+};
+
+struct worker {
+    struct batch *b;
+    struct indent_ctx *ctx;	/* allocated before the threads start */
+};
+
+/*
+ * Whether path would name something outside the directory it is put under.
+ */
+static int
+escapes(const char *path)
+{
+    const char *p;
+
+    if (path[0] == '/')
+	return (1);
+    for (p = path; *p != '\0'; p += strcspn(p, "/")) {
+	p += strspn(p, "/");
+	if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+	    return (1);
+    }
+    return (0);
+}
+
+/*
+ * Create the directories leading up to path.
+ */
+static int
+make_parents(char *path)
+{
+    char *p;
+
+    for (p = path + 1; (p = strchr(p, '/')) != NULL; p++) {
+	*p = '\0';
+	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+	    *p = '/';
+	    return (-1);
+	}
+	*p = '/';
+    }
+    return (0);
+}
+
+/*
+ * Read all of fd into a buffer from a.
+ */
+static char *
+read_all(struct arena *a, int fd, off_t hint, size_t *lenp)
+{
+    char *buf;
+    size_t len = 0, size = hint > 0 ? hint + 1 : 4096;
+    ssize_t r;
+
+    if ((buf = arena_alloc(a, size)) == NULL)
+	return (NULL);
+    for (;;) {
+	if (len == size) {
+	    if ((buf = arena_grow(a, buf, size, size * 2)) == NULL)
+		return (NULL);
+	    size *= 2;
+	}
+	if ((r = read(fd, buf + len, size - len)) == -1 && errno == EINTR)
+	    continue;
+	if (r == -1)
+	    return (NULL);
+	if (r == 0)
+	    break;
+	len += r;
+    }
+    *lenp = len;
+    return (buf);
+}
+
+static int
+write_all(int fd, const char *p, size_t n)
+{
+    ssize_t r;
+
+    while (n > 0) {
+	if ((r = write(fd, p, n)) == -1 && errno == EINTR)
+	    continue;
+	if (r == -1)
+	    return (-1);
+	p += r;
+	n -= r;
+    }
+    return (0);
+}
+
+/*
+ * The line of the first byte where a and b differ.
+ */
+static int
+diff_line(const char *a, size_t alen, const char *b, size_t blen)
+{
+    size_t i;
+    int line = 1;
+
+    for (i = 0; i < alen && i < blen && a[i] == b[i]; i++)
+	if (a[i] == '\n')
+	    line++;
+    return (line);
+}
+
+/*
+ * Format the file open on infd in memory, through the cache if there is
+ * one.  When checking or diffing, only note how the file would change.
+ */
+static int
+format_mem(struct indent_ctx *ctx, struct arena *a, struct batch *b, size_t i,
+    int infd, const struct stat *st, char *dst, char *tmp)
+{
+    struct indent_result res;
+    struct cache_key key;
+    char *in, *out;
+    size_t len, outlen = 0;
+    int outfd, status, save = 0;
+
+    if ((in = read_all(a, infd, st->st_size, &len)) == NULL)
+	return (-errno);
+    if (b->cache != NULL)
+	cache_key(b->cache, in, len, &key);
+    if (b->cache == NULL ||
+	!cache_get(b->cache, &key, len, &out, &outlen, &status)) {
+	status = indent_parallel(ctx, in, len, b->split, &res);
+	out = NULL;		/* already formatted */
+	if (res.outlen != len || memcmp(res.out, in, len) != 0) {
+	    out = res.out;
+	    outlen = res.outlen;
+	    res.out = NULL;
+	}
+	indent_result_free(&res);
+	if (b->cache != NULL)
+	    cache_put(b->cache, &key, len, out, outlen, status);
+    }
+
+    if (b->mode != 0) {
+	b->line[i] = out != NULL ? diff_line(in, len, out, outlen) : 0;
+	if (b->mode == INDENT_DIFF && out != NULL)
+	    b->diff[i] = udiff(in, len, out, outlen, b->paths[i],
+		&b->difflen[i]);
+	status = 0;
+    } else if (out != NULL || b->outdir != NULL) {
+	if (b->outdir == NULL && st->st_nlink > 1)
+	    save = EMLINK;
+	else if ((b->outdir != NULL && make_parents(dst) == -1) ||
+	    (outfd = mkstemp(tmp)) == -1)
+	    save = errno;
+	else if (write_all(outfd, out != NULL ? out : in,
+	    out != NULL ? outlen : len) == -1 ||
+	    fchmod(outfd, st->st_mode & 07777) == -1) {
+	    save = errno;
+	    close(outfd);
+	    unlink(tmp);
+	} else if (close(outfd) == -1 || rename(tmp, dst) == -1) {
+	    save = errno;
+	    unlink(tmp);
+	}
+    }
+    free(out);
+    return (save ? -save : status);
+}
+
+static int
+format_one(struct indent_ctx *ctx, struct arena *a, struct batch *b, size_t i)
+{
+    char dst[PATH_MAX], tmp[PATH_MAX];
+    const char *path = b->paths[i];
+    struct stat st;
+    int infd, outfd, status, save;
+
+    if (b->outdir == NULL) {
+	if (realpath(path, dst) == NULL)
+	    return (-errno);
+	status = strlen(dst);
+    } else if (escapes(path))
+	return (-EINVAL);
+    else
+	status = snprintf(dst, sizeof dst, "%s/%s", b->outdir, path);
+    if (status < 0 || (size_t)status >= sizeof dst ||
+	(size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXXXXXX", dst) >= sizeof tmp)
+	return (-ENAMETOOLONG);
+
+    if ((infd = open(path, O_RDONLY)) == -1)
+	return (-errno);
+    if (b->cache != NULL || b->mode == INDENT_DIFF || b->split > 1) {
+	if (fstat(infd, &st) == -1)
+	    status = -errno;
+	else
+	    status = format_mem(ctx, a, b, i, infd, &st, dst, tmp);
+	close(infd);
+	return (status);
+    }
+    if (b->mode == INDENT_CHECK) {
+	b->line[i] = indent_check(ctx, infd);
+	save = errno;
+	close(infd);
+	if (b->line[i] == -1) {
+	    b->line[i] = 0;
+	    return (-save);
+	}
+	return (0);
+    }
+    if (fstat(infd, &st) == -1 ||
+	(b->outdir != NULL && make_parents(dst) == -1))
+	save = errno;
+    else if (b->outdir == NULL && st.st_nlink > 1)
+	save = EMLINK;
+    else if ((outfd = mkstemp(tmp)) == -1)
+	save = errno;
+    else
+	save = 0;
+    if (save != 0) {
+	close(infd);
+	return (-save);
+    }
+    status = indent_file(ctx, infd, outfd);
+    save = errno;
+    close(infd);
+    if (status == -1) {
+	close(outfd);
+	unlink(tmp);
+	return (-save);
+    }
+    if (fchmod(outfd, st.st_mode & 07777) == -1 || close(outfd) == -1 ||
+	rename(tmp, dst) == -1) {
+	save = errno;
+	unlink(tmp);
+	return (-save);
+    }
+    return (status);
+}
+
+static void *
+worker(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *b = w->b;
+    struct indent_ctx *ctx = w->ctx;
+    struct arena a;
+    size_t i;
+
+    memset(&a, 0, sizeof a);
+    for (;;) {
+	pthread_mutex_lock(&b->lock);
+	i = b->next++;
+	pthread_mutex_unlock(&b->lock);
+	if (i >= b->npaths)
+	    break;
+	b->status[i] = format_one(ctx, &a, b, i);
+	arena_reset(&a);
+    }
+    arena_free(&a);
+    return (NULL);
+}
+
+int
+indent_batch(char **paths, size_t npaths, int nthreads, const char *outdir,
+    const char *cachedir, int mode)
+{
+    struct batch b;
+    struct worker *w;
+    pthread_t *tids;
+    size_t i;
+    int n, ret = 0;
+
+    if (nthreads < 1)
+	nthreads = 1;
+    b.split = 1;
+    if ((size_t)nthreads > npaths) {
+	if (npaths > 0)
+	    b.split = nthreads / npaths;
+	nthreads = npaths > 0 ? npaths : 1;
+    }
+    b.paths = paths;
+    b.npaths = npaths;
+    b.outdir = outdir;
+    b.cache = NULL;
+    if (cachedir != NULL &&
+	(b.cache = cache_open(cachedir, CACHE_SIZE)) == NULL)
+	fprintf(stderr, "%s: %s\n", cachedir, strerror(errno));	/* go on */
+    b.next = 0;
+    b.mode = mode;
+    b.status = calloc(npaths ? npaths : 1, sizeof b.status[0]);
+    b.line = calloc(npaths ? npaths : 1, sizeof b.line[0]);
+    b.diff = calloc(npaths ? npaths : 1, sizeof b.diff[0]);
+    b.difflen = calloc(npaths ? npaths : 1, sizeof b.difflen[0]);
+    tids = calloc(nthreads, sizeof tids[0]);
+    w = calloc(nthreads, sizeof w[0]);
+    if (b.status == NULL || b.line == NULL || b.diff == NULL ||
+	b.difflen == NULL || tids == NULL || w == NULL)
+	return (-1);
+    pthread_mutex_init(&b.lock, NULL);
+
+    /*
+     * Contexts are allocated here, where running out of memory may still
+     * end the program, rather than halfway through the files.
+     */
+    for (n = 0; n < nthreads; n++) {
+	w[n].b = &b;
+	w[n].ctx = indent_alloc();
+    }
+
+    /* the calling thread is one of the workers */
+    for (n = 1; n < nthreads; n++)
+	if (pthread_create(&tids[n], NULL, worker, &w[n]) != 0)
+	    break;
+    worker(&w[0]);
+    while (--n > 0)
+	pthread_join(tids[n], NULL);
+    pthread_mutex_destroy(&b.lock);
+    for (n = 0; n < nthreads; n++)
+	indent_release(w[n].ctx);
+    cache_close(b.cache);
+
+    for (i = 0; i < npaths; i++) {
+	if (b.status[i] < 0) {
+	    fprintf(stderr, "%s: %s\n", paths[i], strerror(-b.status[i]));
+	    ret = 1;
+	} else if (b.line[i] != 0) {
+	    if (b.diff[i] != NULL)
+		fwrite(b.diff[i], 1, b.difflen[i], stdout);
+	    fprintf(stderr, "%s: differs at line %d\n", paths[i], b.line[i]);
+	    if (ret == 0)
+		ret = 2;
+	} else {
+	    fprintf(stderr, "%s: %s\n", paths[i],
+		b.status[i] ? "errors diagnosed" : "ok");
+	    if (b.status[i] != 0)
+		ret = 1;
+	}
+    }
+    for (i = 0; i < npaths; i++)
+	free(b.diff[i]);
+    free(tids);
+    free(w);
+    free(b.diff);
+    free(b.difflen);
+    free(b.line);
+    free(b.status);
+    return (ret);
+}
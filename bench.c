@@ -0,0 +1,269 @@
+/*
+ * Measure how fast the formatter runs.  A fixed corpus is generated in
+ * memory, one part for each kind of input that leans on a different piece
+ * of the formatter, and each part is formatted several times with one
+ * context.  Throughput and peak memory are printed, and written as JSON to
+ * a file so runs can be compared.  With -t the tokens of each part are
+ * found in a pass of their own first (see tokens.c).
+ *
+ *	comments	long and boxed block comments (pr_comment)
+ *	nesting		deeply nested statements (parse, indentation)
+ *	tables		big initializer tables (lexi, dump_line)
+ *	cpp		preprocessor lines (#if stack, label buffer)
+ */
+
+#include <sys/resource.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <unistd.h>
+#include "indent_globs.h"
+
+#define PART_SIZE	(2 * 1024 * 1024)	/* bytes in each part */
+#define ROUNDS		5			/* times each part is formatted */
+
+struct text {
+    char       *buf;
+    size_t      len;
+    size_t      size;
+};
+
+static unsigned long seed = 1;
+
+static unsigned long
+rnd(unsigned long n)
+{
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return ((seed >> 33) % n);
+}
+
+static void
+add(struct text *t, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+	va_start(ap, fmt);
+	n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+	    err(1, "vsnprintf");
+	if ((size_t)n < t->size - t->len)
+	    break;
+	t->size = t->size * 2 + n;
+	if ((t->buf = realloc(t->buf, t->size)) == NULL)
+	    err(1, NULL);
+    }
+    t->len += n;
+}
+
+static const char *words[] = {
+    "the", "buffer", "is", "flushed", "when", "a", "line", "ends", "and",
+    "state", "of", "parser", "saved", "before", "each", "branch", "token",
+    "comment", "column", "indentation", "declaration", "returns", "zero",
+};
+#define NWORDS	(sizeof words / sizeof words[0])
+
+static void
+gen_comments(struct text *t)
+{
+    int i, j, n;
+
+    while (t->len < PART_SIZE) {
+	add(t, "/*\n");
+	for (i = 0, n = 3 + rnd(10); i < n; i++) {
+	    add(t, " *");
+	    for (j = 0; j < 6 + (int)rnd(14); j++)
+		add(t, " %s", words[rnd(NWORDS)]);
+	    add(t, "\n");
+	}
+	add(t, " */\nint v%lu;\t/* %s %s %s */\n", rnd(100000),
+	    words[rnd(NWORDS)], words[rnd(NWORDS)], words[rnd(NWORDS)]);
+	add(t, "/**********\n * %s box\n **********/\n", words[rnd(NWORDS)]);
+	add(t, "int f%lu(void) { return 0; /*", rnd(100000));
+	for (j = 0; j < 16; j++)	/* long enough to be broken up */
+	    add(t, " %s", words[rnd(NWORDS)]);
+	add(t, " */ }\n");
+    }
+}
+
+static void
+gen_nesting(struct text *t)
+{
+    int d, depth;
+
+    while (t->len < PART_SIZE) {
+	add(t, "static int\nn%lu(int a, int b)\n{\nint i = 0;\n", rnd(100000));
+	depth = 4 + rnd(20);
+	for (d = 0; d < depth; d++)
+	    switch (rnd(4)) {
+	    case 0:
+		add(t, "if (a > %d && b != %d) {\n", d, d * 3);
+		break;
+	    case 1:
+		add(t, "for (i = 0; i < %d; i++) {\n", d + 1);
+		break;
+	    case 2:
+		add(t, "while (a-- > b) {\n");
+		break;
+	    default:
+		add(t, "switch (a) {\ncase %d:\n", d);
+		break;
+	    }
+	add(t, "a = (b + i) * %d - (a >> 1);\n", depth);
+	for (d = 0; d < depth; d++)
+	    add(t, "}\n");
+	add(t, "return a;\n}\n");
+    }
+}
+
+static void
+gen_tables(struct text *t)
+{
+    int i, n;
+
+    while (t->len < PART_SIZE) {
+	add(t, "static const struct entry tab%lu[] = {\n", rnd(100000));
+	for (i = 0, n = 50 + rnd(200); i < n; i++)
+	    add(t, "{ %lu, 0x%lx, \"%s\", %s },\n", rnd(1000), rnd(65536),
+		words[rnd(NWORDS)], words[rnd(NWORDS)]);
+	add(t, "};\nstatic int num%lu[] = {", rnd(100000));
+	for (i = 0, n = 100 + rnd(400); i < n; i++)
+	    add(t, "%lu,%s", rnd(100000), i % 10 == 9 ? "\n" : " ");
+	add(t, "0 };\n");
+    }
+}
+
+static void
+gen_cpp(struct text *t)
+{
+    while (t->len < PART_SIZE) {
+	add(t, "#ifdef CONFIG_%lu\n#define M%lu(x)\t((x) + %lu)\n",
+	    rnd(1000), rnd(1000), rnd(1000));
+	add(t, "#if %lu > 3\nint a%lu = M(1);\n#else\nint a%lu = 2;\n#endif\n",
+	    rnd(10), rnd(100000), rnd(100000));
+	add(t, "#include <sys/%s.h>\n#endif /* CONFIG */\n", words[rnd(NWORDS)]);
+	add(t, "#define LONG_%lu \\\n\tdo { \\\n\t\tf(); \\\n\t} while (0)\n",
+	    rnd(100000));
+    }
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static size_t
+count_lines(const struct text *t)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < t->len; i++)
+	if (t->buf[i] == '\n')
+	    n++;
+    return (n);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: bench [-t] [-o file]\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct {
+	const char *name;
+	void (*gen)(struct text *);
+    } parts[] = {
+	{ "comments", gen_comments },
+	{ "nesting", gen_nesting },
+	{ "tables", gen_tables },
+	{ "cpp", gen_cpp },
+    };
+    struct indent_ctx *ctx;
+    struct indent_result res;
+    struct rusage ru;
+    struct text t;
+    const char *outfile = "bench.json";
+    FILE *fp;
+    size_t i, lines, bytes = 0, alllines = 0;
+    unsigned long toks, alltoks = 0;
+    double start, secs, allsecs = 0;
+    int r, ch, tokens = 0;
+
+    while ((ch = getopt(argc, argv, "o:t")) != -1)
+	switch (ch) {
+	case 'o':
+	    outfile = optarg;
+	    break;
+	case 't':
+	    tokens = 1;
+	    break;
+	default:
+	    usage();
+	}
+
+    if ((fp = fopen(outfile, "w")) == NULL)
+	err(1, "%s", outfile);
+    fprintf(fp, "{\n  \"parts\": [\n");
+    ctx = indent_alloc();
+    indent_set_tokens(ctx, tokens);
+    for (i = 0; i < sizeof parts / sizeof parts[0]; i++) {
+	t.len = 0;
+	t.size = PART_SIZE + 4096;
+	if ((t.buf = malloc(t.size)) == NULL)
+	    err(1, NULL);
+	seed = i + 1;
+	parts[i].gen(&t);
+	lines = count_lines(&t);
+
+	toks = ntokens;
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+	    indent_buffer(ctx, t.buf, t.len, &res);
+	    indent_result_free(&res);
+	}
+	secs = now() - start;
+	toks = ntokens - toks;
+
+	printf("%-10s %8.1f MB/s %12.0f lines/s %12.0f tokens/s\n",
+	    parts[i].name, t.len * ROUNDS / secs / 1e6,
+	    lines * ROUNDS / secs, toks / secs);
+	fprintf(fp, "    { \"name\": \"%s\", \"bytes\": %zu, \"lines\": %zu, "
+	    "\"tokens\": %lu, \"rounds\": %d, \"seconds\": %.6f, "
+	    "\"mb_per_s\": %.3f, \"lines_per_s\": %.0f, "
+	    "\"tokens_per_s\": %.0f }%s\n",
+	    parts[i].name, t.len, lines, toks / ROUNDS, ROUNDS, secs,
+	    t.len * ROUNDS / secs / 1e6, lines * ROUNDS / secs, toks / secs,
+	    i + 1 < sizeof parts / sizeof parts[0] ? "," : "");
+	bytes += t.len * ROUNDS;
+	alllines += lines * ROUNDS;
+	alltoks += toks;
+	allsecs += secs;
+	free(t.buf);
+    }
+    indent_release(ctx);
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%-10s %8.1f MB/s %12.0f lines/s %12.0f tokens/s\n"
+	"peak rss   %ld KB\n", "total", bytes / allsecs / 1e6,
+	alllines / allsecs, alltoks / allsecs, ru.ru_maxrss);
+    fprintf(fp, "  ],\n  \"mb_per_s\": %.3f,\n  \"lines_per_s\": %.0f,\n"
+	"  \"tokens_per_s\": %.0f,\n  \"peak_rss_kb\": %ld\n}\n",
+	bytes / allsecs / 1e6, alllines / allsecs, alltoks / allsecs,
+	ru.ru_maxrss);
+    if (fclose(fp) == EOF)
+	err(1, "%s", outfile);
+    return (0);
+}
@@ -0,0 +1,310 @@
+/*
+ * A cache of formatting results on disk, so that formatting the same
+ * unchanged files again (as a CI job does on every run) costs a hash of
+ * each file and a lookup instead of a formatting run.
+ *
+ * An entry is a file in the cache directory named by a 128 bit hash of the
+ * input bytes, seeded with a fingerprint of the formatter.  It holds the
+ * status and the formatted text, or only a bit saying the input is already
+ * formatted.  Entries are written to a temporary file and renamed into
+ * place, so any number of processes can share the directory: a reader sees
+ * a whole entry or none, and two writers of the same key write the same
+ * bytes.  A hit touches the entry's modification time, and when the cache
+ * is closed the least recently used entries are removed until the total
+ * size is under the bound again.
+ */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+
+/*
+ * Bump when the output for some input changes, or when the entry layout
+ * does, so that results from an older formatter are not used.  There are
+ * no options that change the output of a batch run, so the version is the
+ * whole fingerprint.
+ */
+#define CACHE_VERSION	"indent cache 1"
+
+#define CACHE_MAGIC	0x696e64656e7431ULL	/* "indent1" */
+#define F_CANONICAL	0x1	/* the output is the input */
+#define TMP_AGE		3600	/* seconds before a stray temporary goes */
+
+struct cache {
+    char        dir[PATH_MAX];
+    long        max;		/* bound on the total size of the entries */
+    uint64_t    seed[2];	/* the fingerprint */
+};
+
+struct entry_hdr {
+    uint64_t    magic;
+    uint64_t    inlen;		/* to catch a collision that slips through */
+    uint64_t    outlen;
+    int32_t     status;
+    int32_t     flags;
+};
+
+#define K0	0x9e3779b97f4a7c15ULL
+#define K1	0xc2b2ae3d27d4eb4fULL
+
+static uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (h);
+}
+
+/*
+ * Two independent 64 bit hashes of p, a word at a time.
+ */
+static void
+hash128(const char *p, size_t len, const uint64_t seed[2], uint64_t h[2])
+{
+    uint64_t a = seed[0], b = seed[1], w;
+    size_t n = len;
+
+    for (; n >= 8; p += 8, n -= 8) {
+	memcpy(&w, p, 8);
+	a = (a ^ w) * K0;
+	a ^= a >> 29;
+	b = (b + w) * K1;
+	b ^= b >> 31;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h[0] = mix(a ^ w ^ (uint64_t)len);
+    h[1] = mix(b + w + ((uint64_t)len << 1));
+}
+
+struct cache *
+cache_open(const char *dir, long max)
+{
+    static const uint64_t zero[2];
+    struct cache *c;
+
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+	return (NULL);
+    if ((c = calloc(1, sizeof *c)) == NULL)
+	return (NULL);
+    if ((size_t)snprintf(c->dir, sizeof c->dir, "%s", dir) >= sizeof c->dir) {
+	free(c);
+	errno = ENAMETOOLONG;
+	return (NULL);
+    }
+    c->max = max;
+    hash128(CACHE_VERSION, sizeof CACHE_VERSION - 1, zero, c->seed);
+    return (c);
+}
+
+void
+cache_key(const struct cache *c, const char *in, size_t len,
+    struct cache_key *key)
+{
+    uint64_t h[2];
+
+    hash128(in, len, c->seed, h);
+    snprintf(key->name, sizeof key->name, "%016llx%016llx",
+	(unsigned long long)h[0], (unsigned long long)h[1]);
+}
+
+static int
+read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t r;
+
+    while (n > 0) {
+	if ((r = read(fd, p, n)) == -1 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return (-1);
+	p += r;
+	n -= r;
+    }
+    return (0);
+}
+
+static int
+write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    ssize_t r;
+
+    while (n > 0) {
+	if ((r = write(fd, p, n)) == -1 && errno == EINTR)
+	    continue;
+	if (r == -1)
+	    return (-1);
+	p += r;
+	n -= r;
+    }
+    return (0);
+}
+
+/*
+ * Look up the result for an input of inlen bytes.  Returns 1 on a hit with
+ * the status in *status and the output in *out, to be freed, or NULL in
+ * *out if the input is already formatted.  Returns 0 on a miss.
+ */
+int
+cache_get(struct cache *c, const struct cache_key *key, size_t inlen,
+    char **out, size_t *outlen, int *status)
+{
+    char path[PATH_MAX];
+    struct entry_hdr h;
+    struct stat st;
+    char *buf = NULL;
+    int fd;
+
+    if ((size_t)snprintf(path, sizeof path, "%s/%s", c->dir, key->name) >=
+	sizeof path || (fd = open(path, O_RDONLY)) == -1)
+	return (0);
+    if (fstat(fd, &st) == -1 || read_full(fd, &h, sizeof h) == -1 ||
+	h.magic != CACHE_MAGIC || h.inlen != inlen ||
+	(uint64_t)st.st_size != sizeof h + h.outlen ||
+	((h.flags & F_CANONICAL) && h.outlen != 0))
+	goto miss;
+    if (!(h.flags & F_CANONICAL)) {
+	if ((buf = malloc(h.outlen + 1)) == NULL ||
+	    read_full(fd, buf, h.outlen) == -1)
+	    goto miss;
+	buf[h.outlen] = '\0';
+    }
+    futimens(fd, NULL);		/* recently used */
+    close(fd);
+    *out = buf;
+    *outlen = h.outlen;
+    *status = h.status;
+    return (1);
+miss:
+    free(buf);
+    close(fd);
+    return (0);
+}
+
+/*
+ * Store the result for an input of inlen bytes.  A NULL out means the
+ * input is already formatted.  A result that cannot be stored is not an
+ * error; the next run will format the input again.
+ */
+void
+cache_put(struct cache *c, const struct cache_key *key, size_t inlen,
+    const char *out, size_t outlen, int status)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct entry_hdr h;
+    int fd;
+
+    if ((size_t)snprintf(path, sizeof path, "%s/%s", c->dir, key->name) >=
+	sizeof path || (size_t)snprintf(tmp, sizeof tmp,
+	"%s/tmp.XXXXXXXXXX", c->dir) >= sizeof tmp ||
+	(fd = mkstemp(tmp)) == -1)
+	return;
+    memset(&h, 0, sizeof h);
+    h.magic = CACHE_MAGIC;
+    h.inlen = inlen;
+    h.outlen = out != NULL ? outlen : 0;
+    h.status = status;
+    h.flags = out != NULL ? 0 : F_CANONICAL;
+    if (write_full(fd, &h, sizeof h) == -1 ||
+	(out != NULL && write_full(fd, out, outlen) == -1) ||
+	fchmod(fd, 0644) == -1) {
+	close(fd);
+	unlink(tmp);
+	return;
+    }
+    if (close(fd) == -1 || rename(tmp, path) == -1)
+	unlink(tmp);
+}
+
+struct lru {
+    struct timespec used;
+    off_t       size;
+    char        name[sizeof ((struct cache_key *)0)->name];
+};
+
+static int
+lru_cmp(const void *a, const void *b)
+{
+    const struct lru *x = a, *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec)
+	return (x->used.tv_sec < y->used.tv_sec ? -1 : 1);
+    if (x->used.tv_nsec != y->used.tv_nsec)
+	return (x->used.tv_nsec < y->used.tv_nsec ? -1 : 1);
+    return (strcmp(x->name, y->name));
+}
+
+/*
+ * Remove the least recently used entries until the total is a quarter
+ * below the bound, so that a run adding a few entries does not have to
+ * trim again at once.  Other processes may be trimming too; an entry that
+ * is already gone is not an error.
+ */
+static void
+cache_trim(struct cache *c)
+{
+    struct lru *v = NULL, *nv;
+    struct dirent *de;
+    struct stat st;
+    size_t n = 0, max = 0, i;
+    long long total = 0;
+    time_t now = time(NULL);
+    DIR *d;
+
+    if ((d = opendir(c->dir)) == NULL)
+	return;
+    while ((de = readdir(d)) != NULL) {
+	if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    !S_ISREG(st.st_mode))
+	    continue;
+	if (strncmp(de->d_name, "tmp.", 4) == 0) {
+	    if (now - st.st_mtime > TMP_AGE)	/* left by a killed run */
+		unlinkat(dirfd(d), de->d_name, 0);
+	    continue;
+	}
+	if (strlen(de->d_name) != sizeof v->name - 1)
+	    continue;
+	if (n >= max) {
+	    max = max ? max * 2 : 256;
+	    if ((nv = reallocarray(v, max, sizeof v[0])) == NULL)
+		break;
+	    v = nv;
+	}
+	v[n].used = st.st_mtim;
+	v[n].size = st.st_size;
+	memcpy(v[n].name, de->d_name, sizeof v[n].name);
+	total += st.st_size;
+	n++;
+    }
+    if (total > c->max) {
+	qsort(v, n, sizeof v[0], lru_cmp);
+	for (i = 0; i < n && total > c->max - c->max / 4; i++)
+	    if (unlinkat(dirfd(d), v[i].name, 0) == 0 || errno == ENOENT)
+		total -= v[i].size;
+    }
+    free(v);
+    closedir(d);
+}
+
+void
+cache_close(struct cache *c)
+{
+    if (c == NULL)
+	return;
+    cache_trim(c);
+    free(c);
+}
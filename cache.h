@@ -0,0 +1,28 @@
+/*
+ * An on-disk cache of formatting results, keyed by the input bytes.  See
+ * cache.c.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#define CACHE_SIZE	(256L * 1024 * 1024)	/* default bound, in bytes */
+
+struct cache;
+
+struct cache_key {
+    char        name[33];	/* 128 bits in hex, the entry's file name */
+};
+
+struct cache *cache_open(const char *, long);
+void cache_close(struct cache *);
+void cache_key(const struct cache *, const char *, size_t,
+	struct cache_key *);
+int cache_get(struct cache *, const struct cache_key *, size_t, char **,
+	size_t *, int *);
+void cache_put(struct cache *, const struct cache_key *, size_t,
+	const char *, size_t, int);
+
+#endif /* CACHE_H */
@@ -0,0 +1,636 @@
+/*
+ * Show what formatting would change as a unified diff of the input against
+ * the output, made in the same process instead of by piping the output to
+ * diff(1), or as a list of edits to the input for an editor to apply.
+ *
+ * The texts are split into lines, and a line is compared by its hash
+ * first.  A line that does not occur in the other text at all is changed
+ * whatever the rest looks like, so it is marked as such at once and left
+ * out of the search; reindented lines, which are most of what formatting
+ * changes, usually go this way.  The lines the texts have in common at the
+ * start and the end are taken off, and the rest is diffed with Myers'
+ * algorithm in linear space: the middle snake of the shortest edit script
+ * is found by searching from both ends at once, and the parts before and
+ * after it are diffed the same way.  As in diff(1), a search that gets too
+ * expensive settles for the furthest it got, and the script is then no
+ * longer the shortest.  The changes are printed with three lines of
+ * context, the way diff -u prints them.
+ *
+ * An edit replaces the bytes from start up to end of the input with a
+ * string.  There is one for each run of changed lines, with the bytes the
+ * old and new lines have in common at either end taken off, so that
+ * reindenting a line is an edit of its leading white space only.  The list
+ * is JSON:
+ *
+ *	[{"start":0,"end":4,"replacement":"\t"},...]
+ *
+ * The offsets count bytes.  An edit never splits a UTF-8 sequence.  A
+ * replacement that is valid UTF-8 is copied into the string as it is, but
+ * one that is not (formatting can cut a sequence when it reflows a comment,
+ * and the input need not be UTF-8 at all) has no JSON string that decodes
+ * to its bytes.  It is given instead as "replacement_bytes", the bytes in
+ * base64:
+ *
+ *	{"start":10,"end":12,"replacement_bytes":"6Q=="}
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "indent.h"
+#include "diff.h"
+
+#define CONTEXT	3		/* lines of context around a change */
+
+struct line {
+    const char *p;
+    size_t      len;		/* with the newline, if there is one */
+    uint32_t    h;
+};
+
+struct text {
+    struct line *l;
+    int         n;
+    char       *mark;		/* per line: set if deleted or inserted */
+    int        *idx;		/* the lines left to search */
+    int         nidx;
+};
+
+struct diff {
+    struct text a, b;
+    int        *vf;		/* furthest x on each diagonal, forward */
+    int        *vb;		/* ... and backward */
+    int         too_expensive;	/* edit cost at which to settle */
+};
+
+struct buf {
+    char       *s;
+    size_t      len;
+    size_t      size;
+};
+
+static void
+split(struct text *t, const char *p, size_t len)
+{
+    const char *end = p + len, *nl;
+    int n, i;
+    uint32_t h;
+
+    for (n = 0, nl = p; nl < end; n++)
+	nl = (nl = memchr(nl, '\n', end - nl)) != NULL ? nl + 1 : end;
+    t->l = calloc(n ? n : 1, sizeof t->l[0]);
+    t->mark = calloc(n ? n : 1, 1);
+    if (t->l == NULL || t->mark == NULL)
+	err(1, NULL);
+    for (t->n = 0; p < end; t->n++, p = nl) {
+	nl = (nl = memchr(p, '\n', end - p)) != NULL ? nl + 1 : end;
+	for (h = 2166136261U, i = 0; p + i < nl; i++)
+	    h = (h ^ (unsigned char)p[i]) * 16777619U;
+	t->l[t->n].p = p;
+	t->l[t->n].len = nl - p;
+	t->l[t->n].h = h;
+    }
+}
+
+/*
+ * Mark the lines of t whose hashes are not among those of o, which cannot
+ * be equal to any line of o, and leave the others in t->idx.
+ */
+static void
+discard(struct text *t, const struct text *o)
+{
+    uint32_t *set, h;
+    size_t size, i;
+    int j;
+
+    for (size = 16; size < (size_t)o->n * 2; size *= 2)
+	;
+    if ((set = calloc(size, sizeof set[0])) == NULL ||
+	(t->idx = calloc(t->n ? t->n : 1, sizeof t->idx[0])) == NULL)
+	err(1, NULL);
+    for (j = 0; j < o->n; j++) {	/* hash 0 is stored as 1 */
+	h = o->l[j].h ? o->l[j].h : 1;
+	for (i = h & (size - 1); set[i] != 0 && set[i] != h;
+	    i = (i + 1) & (size - 1))
+	    ;
+	set[i] = h;
+    }
+    for (t->nidx = j = 0; j < t->n; j++) {
+	h = t->l[j].h ? t->l[j].h : 1;
+	for (i = h & (size - 1); set[i] != 0 && set[i] != h;
+	    i = (i + 1) & (size - 1))
+	    ;
+	if (set[i] == 0)
+	    t->mark[j] = 1;
+	else
+	    t->idx[t->nidx++] = j;
+    }
+    free(set);
+}
+
+static int
+same(const struct diff *d, int i, int j)
+{
+    const struct line *x = &d->a.l[d->a.idx[i]], *y = &d->b.l[d->b.idx[j]];
+
+    return (x->h == y->h && x->len == y->len &&
+	memcmp(x->p, y->p, x->len) == 0);
+}
+
+/*
+ * Find the middle snake of the shortest edit script from a[a0..a1) to
+ * b[b0..b1), both non-empty, and return in *x and *y a point on it.  If
+ * that costs too much, return the point the forward search got furthest
+ * to instead.
+ */
+static void
+middle(struct diff *d, int a0, int a1, int b0, int b1, int *sx, int *sy)
+{
+    int n = a1 - a0, m = b1 - b0, delta = n - m, odd = delta & 1;
+    int max = (n + m + 1) / 2, dd, k, c, x, y, best;
+    int *vf = d->vf + max + 1, *vb = d->vb + max + 1;
+
+    vf[1] = vb[1] = 0;
+    for (dd = 0; dd <= max; dd++) {
+	for (k = -dd; k <= dd; k += 2) {
+	    x = k == -dd || (k != dd && vf[k - 1] < vf[k + 1]) ?
+		vf[k + 1] : vf[k - 1] + 1;
+	    y = x - k;
+	    while (x < n && y < m && same(d, a0 + x, b0 + y))
+		x++, y++;
+	    vf[k] = x;
+	    c = delta - k;
+	    if (odd && c >= -(dd - 1) && c <= dd - 1 && x + vb[c] >= n) {
+		*sx = a0 + x;
+		*sy = b0 + y;
+		return;
+	    }
+	}
+	for (c = -dd; c <= dd; c += 2) {
+	    x = c == -dd || (c != dd && vb[c - 1] < vb[c + 1]) ?
+		vb[c + 1] : vb[c - 1] + 1;
+	    y = x - c;
+	    while (x < n && y < m && same(d, a1 - x - 1, b1 - y - 1))
+		x++, y++;
+	    vb[c] = x;
+	    k = delta - c;
+	    if (!odd && k >= -dd && k <= dd && x + vf[k] >= n) {
+		*sx = a1 - x;
+		*sy = b1 - y;
+		return;
+	    }
+	}
+	if (dd >= d->too_expensive)
+	    break;
+    }
+    *sx = a0;			/* replaced below, as dd > 0 */
+    *sy = b0;
+    for (best = -1, k = -dd; k <= dd; k += 2) {
+	x = vf[k] < n ? vf[k] : n;
+	y = x - k;
+	if (y > m) {
+	    x -= y - m;
+	    y = m;
+	}
+	if (y >= 0 && x + y > best) {
+	    best = x + y;
+	    *sx = a0 + x;
+	    *sy = b0 + y;
+	}
+    }
+}
+
+static void
+compare(struct diff *d, int a0, int a1, int b0, int b1)
+{
+    int x, y;
+
+    while (a0 < a1 && b0 < b1 && same(d, a0, b0))
+	a0++, b0++;
+    while (a0 < a1 && b0 < b1 && same(d, a1 - 1, b1 - 1))
+	a1--, b1--;
+    if (a0 == a1) {
+	while (b0 < b1)
+	    d->b.mark[d->b.idx[b0++]] = 1;
+	return;
+    }
+    if (b0 == b1) {
+	while (a0 < a1)
+	    d->a.mark[d->a.idx[a0++]] = 1;
+	return;
+    }
+    middle(d, a0, a1, b0, b1, &x, &y);
+    compare(d, a0, x, b0, y);
+    compare(d, x, a1, y, b1);
+}
+
+static void
+put(struct buf *o, const char *s, size_t n)
+{
+    if (o->size - o->len < n + 1) {
+	while (o->size - o->len < n + 1)
+	    o->size = o->size ? o->size * 2 : 4096;
+	if ((o->s = realloc(o->s, o->size)) == NULL)
+	    err(1, NULL);
+    }
+    memcpy(o->s + o->len, s, n);
+    o->len += n;
+    o->s[o->len] = '\0';
+}
+
+static void
+put_line(struct buf *o, int c, const struct line *l)
+{
+    static const char nonl[] = "\n\\ No newline at end of file\n";
+    char ch = c;
+
+    put(o, &ch, 1);
+    put(o, l->p, l->len);
+    if (l->len == 0 || l->p[l->len - 1] != '\n')
+	put(o, nonl, sizeof nonl - 1);
+}
+
+/*
+ * The range of a hunk as diff -u prints it: an empty range is given by the
+ * line before it.
+ */
+static void
+put_range(struct buf *o, int start, int n)
+{
+    char s[32];
+
+    if (n == 1)
+	snprintf(s, sizeof s, "%d", start + 1);
+    else
+	snprintf(s, sizeof s, "%d,%d", n == 0 ? start : start + 1, n);
+    put(o, s, strlen(s));
+}
+
+/*
+ * Print the hunk starting at line i of a and j of b, and return the end of
+ * it in *ip and *jp.
+ */
+static void
+hunk(struct diff *d, struct buf *o, int *ip, int *jp)
+{
+    int i = *ip, j = *jp, ei, ej, k, run;
+
+    /* find the end: the first run of more than 2 * CONTEXT equal lines */
+    for (ei = i, ej = j;;) {
+	while (ei < d->a.n && d->a.mark[ei])
+	    ei++;
+	while (ej < d->b.n && d->b.mark[ej])
+	    ej++;
+	for (run = 0; ei + run < d->a.n && ej + run < d->b.n &&
+	    !d->a.mark[ei + run] && !d->b.mark[ej + run]; run++)
+	    ;
+	if (ei + run == d->a.n && ej + run == d->b.n) {
+	    run = run < CONTEXT ? run : CONTEXT;
+	    ei += run;
+	    ej += run;
+	    break;
+	}
+	if (run > 2 * CONTEXT) {
+	    ei += CONTEXT;
+	    ej += CONTEXT;
+	    break;
+	}
+	ei += run;
+	ej += run;
+    }
+
+    k = i < CONTEXT ? i : CONTEXT;
+    if (j < k)
+	k = j;
+    i -= k;
+    j -= k;
+    put(o, "@@ -", 4);
+    put_range(o, i, ei - i);
+    put(o, " +", 2);
+    put_range(o, j, ej - j);
+    put(o, " @@\n", 4);
+    while (i < ei || j < ej) {
+	if (i < ei && d->a.mark[i])
+	    put_line(o, '-', &d->a.l[i++]);
+	else if (j < ej && d->b.mark[j])
+	    put_line(o, '+', &d->b.l[j++]);
+	else {
+	    put_line(o, ' ', &d->a.l[i++]);
+	    j++;
+	}
+    }
+    *ip = ei;
+    *jp = ej;
+}
+
+/*
+ * Diff the lines of a against those of b, marking the lines that differ.
+ */
+static void
+diff_lines(struct diff *d, const char *a, size_t alen, const char *b,
+    size_t blen)
+{
+    int max, k;
+
+    split(&d->a, a, alen);
+    split(&d->b, b, blen);
+    discard(&d->a, &d->b);
+    discard(&d->b, &d->a);
+    max = (d->a.nidx + d->b.nidx + 1) / 2;
+    d->vf = calloc(2 * max + 3, sizeof d->vf[0]);
+    d->vb = calloc(2 * max + 3, sizeof d->vb[0]);
+    if (d->vf == NULL || d->vb == NULL)
+	err(1, NULL);
+    for (d->too_expensive = 1, k = d->a.nidx + d->b.nidx; k != 0; k >>= 2)
+	d->too_expensive <<= 1;	/* about the square root, as diff(1) */
+    if (d->too_expensive < 4096)
+	d->too_expensive = 4096;
+    compare(d, 0, d->a.nidx, 0, d->b.nidx);
+}
+
+static void
+diff_free(struct diff *d)
+{
+    free(d->vf);
+    free(d->vb);
+    free(d->a.l);
+    free(d->a.mark);
+    free(d->a.idx);
+    free(d->b.l);
+    free(d->b.mark);
+    free(d->b.idx);
+}
+
+/*
+ * Make a unified diff of the alen bytes at a against the blen bytes at b,
+ * with name in the header for both.  Returns the diff, which is to be
+ * freed, with its length in *lenp; NULL and a length of 0 if the texts are
+ * the same.
+ */
+char *
+udiff(const char *a, size_t alen, const char *b, size_t blen,
+    const char *name, size_t *lenp)
+{
+    struct diff d;
+    struct buf o;
+    int i, j;
+
+    memset(&o, 0, sizeof o);
+    *lenp = 0;
+    if (alen == blen && memcmp(a, b, alen) == 0)
+	return (NULL);
+    diff_lines(&d, a, alen, b, blen);
+
+
+    put(&o, "--- ", 4);
+    put(&o, name, strlen(name));
+    put(&o, "\n+++ ", 5);
+    put(&o, name, strlen(name));
+    put(&o, "\n", 1);
+    for (i = j = 0; i < d.a.n || j < d.b.n;) {
+	if (i < d.a.n && j < d.b.n && !d.a.mark[i] && !d.b.mark[j]) {
+	    i++;
+	    j++;
+	} else
+	    hunk(&d, &o, &i, &j);
+    }
+    diff_free(&d);
+    *lenp = o.len;
+    return (o.s);
+}
+
+static void
+put_num(struct buf *o, const char *key, size_t n)
+{
+    char s[64];
+
+    snprintf(s, sizeof s, "\"%s\":%zu,", key, n);
+    put(o, s, strlen(s));
+}
+
+/*
+ * The length of the valid UTF-8 sequence of more than one byte at p, or 0.
+ */
+static size_t
+utf8_len(const unsigned char *p, size_t n)
+{
+    size_t len, i;
+    unsigned char lo = 0x80, hi = 0xbf;	/* for the second byte */
+
+    if (*p >= 0xc2 && *p <= 0xdf)
+	len = 2;
+    else if (*p >= 0xe0 && *p <= 0xef) {
+	len = 3;
+	if (*p == 0xe0)
+	    lo = 0xa0;		/* not overlong */
+	else if (*p == 0xed)
+	    hi = 0x9f;		/* not a surrogate */
+    } else if (*p >= 0xf0 && *p <= 0xf4) {
+	len = 4;
+	if (*p == 0xf0)
+	    lo = 0x90;
+	else if (*p == 0xf4)
+	    hi = 0x8f;		/* not past U+10FFFF */
+    } else
+	return (0);
+    if (n < len || p[1] < lo || p[1] > hi)
+	return (0);
+    for (i = 2; i < len; i++)
+	if (p[i] < 0x80 || p[i] > 0xbf)
+	    return (0);
+    return (len);
+}
+
+/*
+ * Whether the n bytes at p are all valid UTF-8.
+ */
+static int
+is_utf8(const char *p, size_t n)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    size_t len;
+
+    while (n > 0) {
+	if (*s < 0x80)
+	    len = 1;
+	else if ((len = utf8_len(s, n)) == 0)
+	    return (0);
+	s += len;
+	n -= len;
+    }
+    return (1);
+}
+
+/*
+ * Put the n bytes at p as a JSON string of their base64 encoding.
+ */
+static void
+put_base64(struct buf *o, const char *p, size_t n)
+{
+    static const char digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *s = (const unsigned char *)p;
+    char q[4];
+    uint32_t v;
+
+    put(o, "\"", 1);
+    for (; n > 0; s += 3, n -= n < 3 ? n : 3) {
+	v = s[0] << 16 | (n > 1 ? s[1] << 8 : 0) | (n > 2 ? s[2] : 0);
+	q[0] = digits[v >> 18];
+	q[1] = digits[v >> 12 & 0x3f];
+	q[2] = n > 1 ? digits[v >> 6 & 0x3f] : '=';
+	q[3] = n > 2 ? digits[v & 0x3f] : '=';
+	put(o, q, 4);
+    }
+    put(o, "\"", 1);
+}
+
+/*
+ * Put the n bytes at p, which are valid UTF-8, as a JSON string.
+ */
+static void
+put_string(struct buf *o, const char *p, size_t n)
+{
+    char s[8];
+    size_t len;
+
+    put(o, "\"", 1);
+    for (; n > 0; p++, n--) {
+	switch (*p) {
+	case '"':
+	case '\\':
+	    s[0] = '\\';
+	    s[1] = *p;
+	    put(o, s, 2);
+	    break;
+	case '\n':
+	    put(o, "\\n", 2);
+	    break;
+	case '\t':
+	    put(o, "\\t", 2);
+	    break;
+	default:
+	    if ((unsigned char)*p < 0x80 && (unsigned char)*p >= 0x20)
+		put(o, p, 1);
+	    else if ((len = utf8_len((const unsigned char *)p, n)) > 0) {
+		put(o, p, len);
+		p += len - 1;
+		n -= len - 1;
+	    } else {		/* a control character */
+		snprintf(s, sizeof s, "\\u%04x", (unsigned char)*p);
+		put(o, s, 6);
+	    }
+	}
+    }
+    put(o, "\"", 1);
+}
+
+#define CONT(c)	(((c) & 0xc0) == 0x80)	/* a UTF-8 continuation byte */
+
+/*
+ * Make the list of edits that turn the alen bytes at a into the blen bytes
+ * at b.  Returns the list, which is to be freed, with its length in *lenp.
+ */
+char *
+uedits(const char *a, size_t alen, const char *b, size_t blen, size_t *lenp)
+{
+    struct diff d;
+    struct buf o;
+    const char *as, *ae, *bs, *be;
+    size_t pre, suf;
+    int i, j, ei, ej, first = 1;
+
+    memset(&o, 0, sizeof o);
+    put(&o, "[", 1);
+    if (alen == blen && memcmp(a, b, alen) == 0)
+	goto done;
+    diff_lines(&d, a, alen, b, blen);
+    for (i = j = 0; i < d.a.n || j < d.b.n;) {
+	if (i < d.a.n && j < d.b.n && !d.a.mark[i] && !d.b.mark[j]) {
+	    i++;
+	    j++;
+	    continue;
+	}
+	for (ei = i; ei < d.a.n && d.a.mark[ei]; ei++)
+	    ;
+	for (ej = j; ej < d.b.n && d.b.mark[ej]; ej++)
+	    ;
+	as = i < d.a.n ? d.a.l[i].p : a + alen;
+	ae = ei < d.a.n ? d.a.l[ei].p : a + alen;
+	bs = j < d.b.n ? d.b.l[j].p : b + blen;
+	be = ej < d.b.n ? d.b.l[ej].p : b + blen;
+	for (pre = 0; as + pre < ae && bs + pre < be && as[pre] == bs[pre];
+	    pre++)
+	    ;
+	while (pre > 0 && as + pre < ae && CONT(as[pre]))
+	    pre--;
+	as += pre;
+	bs += pre;
+	for (suf = 0; ae - suf > as && be - suf > bs &&
+	    ae[-suf - 1] == be[-suf - 1]; suf++)
+	    ;
+	while (suf > 0 && CONT(ae[-suf]))
+	    suf--;
+	ae -= suf;
+	be -= suf;
+	if (as < ae || bs < be) {
+	    put(&o, first ? "{" : ",{", first ? 1 : 2);
+	    put_num(&o, "start", as - a);
+	    put_num(&o, "end", ae - a);
+	    if (is_utf8(bs, be - bs)) {
+		put(&o, "\"replacement\":", 14);
+		put_string(&o, bs, be - bs);
+	    } else {
+		put(&o, "\"replacement_bytes\":", 20);
+		put_base64(&o, bs, be - bs);
+	    }
+	    put(&o, "}", 1);
+	    first = 0;
+	}
+	i = ei;
+	j = ej;
+    }
+    diff_free(&d);
+done:
+    put(&o, "]\n", 2);
+    *lenp = o.len;
+    return (o.s);
+}
+
+int
+indent_diff(struct indent_ctx *ctx, const char *name, const char *in,
+    size_t len, struct indent_result *res)
+{
+    char *diff;
+    size_t n;
+
+    if (in == NULL)
+	in = "";
+    indent_buffer(ctx, in, len, res);
+    diff = udiff(in, len, res->out, res->outlen, name, &n);
+    free(res->out);
+    if (diff == NULL && (diff = strdup("")) == NULL)
+	err(1, NULL);
+    res->out = diff;
+    res->outlen = n;
+    return (res->status);
+}
+
+int
+indent_edits(struct indent_ctx *ctx, const char *in, size_t len,
+    struct indent_result *res)
+{
+    char *edits;
+    size_t n;
+
+    if (in == NULL)
+	in = "";
+    indent_buffer(ctx, in, len, res);
+    edits = uedits(in, len, res->out, res->outlen, &n);
+    free(res->out);
+    res->out = edits;
+    res->outlen = n;
+    return (res->status);
+}
@@ -0,0 +1,14 @@
+/*
+ * Unified diffs and edit lists between two texts.  See diff.c.
+ */
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stddef.h>
+
+char *udiff(const char *, size_t, const char *, size_t, const char *,
+	size_t *);
+char *uedits(const char *, size_t, const char *, size_t, size_t *);
+
+#endif /* DIFF_H */
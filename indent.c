@@ -44,56 +44,267 @@
 #include <errno.h>
 #include <err.h>
 
+/*
+ * Allocate a formatting context with its buffers.  The context can be used
+ * for any number of inputs, one after another.
+ */
+struct indent_ctx *
+indent_alloc(void)
+{
+    struct indent_ctx *ctx;
+
+    if ((ctx = calloc(1, sizeof *ctx)) == NULL)
+	err(1, NULL);
+    grow_buf(&ctx->com, 1);
+    grow_buf(&ctx->lab, 1);
+    grow_buf(&ctx->code, 1);
+    grow_buf(&ctx->tok, 1);
+
+    if ((save_com = malloc(sc_size)) == NULL)
+	err(1, NULL);
+    sc_limit = save_com + sc_size;
+    in_buffer = malloc(10);
+    if (in_buffer == NULL)
+	    err(1, NULL);
+    in_buffer_limit = in_buffer + 8;
+    ps_grow(&ps, 0);
+    ps_grow_parens(&ps, 1);
+    di_size = 20;
+    if ((di_stack = calloc(di_size, sizeof di_stack[0])) == NULL)
+	err(1, NULL);
+    keywords_init(ctx);
+    in_fd = STDIN_FILENO;
+    out_fd = STDOUT_FILENO;
+    return (ctx);
+}
+
+void
+indent_release(struct indent_ctx *ctx)
+{
+    int i;
+
+    close_input(ctx);
+    keywords_free(ctx);
+    free(combuf);
+    free(labbuf);
+    free(codebuf);
+    free(tokenbuf);
+    free(in_buffer);
+    free(save_com);
+    ps_free(&ps);
+    for (i = 0; i < state_size; i++)
+	ps_free(&state_stack[i]);
+    free(state_stack);
+    free(di_stack);
+    free(rd_buf);
+    free(out_buf);
+    clear_diags(ctx);
+    free(diag_buf);
+    free(ranges);
+    reformat_free(ctx);
+    arena_free(&ctx->arena);
+    free(ctx);
+}
+
+static int
+range_cmp(const void *a, const void *b)
+{
+    const struct indent_range *x = a, *y = b;
+
+    return (x->first < y->first ? -1 : x->first > y->first);
+}
+
+/*
+ * Format only the lines in the n ranges given, and copy the rest of the
+ * input as it is.  The ranges are kept sorted, with overlapping and
+ * adjacent ones merged, so fill_buffer can walk them in step with the
+ * input.  With n 0 every line is formatted again.
+ */
+void
+indent_set_ranges(struct indent_ctx *ctx, const struct indent_range *r,
+    size_t n)
+{
+    size_t i, j;
+
+    free(ranges);
+    ranges = NULL;
+    nranges = 0;
+    if (n == 0)
+	return;
+    if ((ranges = reallocarray(NULL, n, sizeof ranges[0])) == NULL)
+	err(1, NULL);
+    memcpy(ranges, r, n * sizeof ranges[0]);
+    qsort(ranges, n, sizeof ranges[0], range_cmp);
+    for (i = 0, j = 1; j < n; j++) {
+	if (ranges[j].first - 1 <= ranges[i].last) {
+	    if (ranges[j].last > ranges[i].last)
+		ranges[i].last = ranges[j].last;
+	} else
+	    ranges[++i] = ranges[j];
+    }
+    nranges = i + 1;
+}
+
+void
+indent_set_tokens(struct indent_ctx *ctx, int on)
+{
+    ctx->tok_on = on;
+}
+
+int
+indent_file(struct indent_ctx *ctx, int infd, int outfd)
+{
+    int status;
+
+    in_fd = infd;
+    out_fd = outfd;
+    io_err = 0;
+    status = indent_format(ctx);
+    if (io_err != 0) {
+	errno = io_err;
+	return (-1);
+    }
+    return (status);
+}
+
+int
+indent_check(struct indent_ctx *ctx, int infd)
+{
+    in_fd = infd;
+    out_fd = -1;
+    chk_on = 1;
+    io_err = 0;
+    indent_format(ctx);
+    chk_on = 0;
+    out_ptr = out_buf;
+    out_fd = STDOUT_FILENO;
+    if (io_err != 0) {
+	errno = io_err;
+	return (-1);
+    }
+    return (chk_line);
+}
+
 int
-main(void)
+indent_buffer(struct indent_ctx *ctx, const char *in, size_t len,
+    struct indent_result *res)
 {
+    struct indent_ctx *tmp = NULL;
+    int own = 0;
+
+    if (ctx == NULL)
+	ctx = tmp = indent_alloc();
+    if (in == NULL)
+	in = "";
+    in_fd = -1;
+    map_ptr = (char *)in;
+    map_end = map_ptr + len;
+    out_fd = -1;
+    /*
+     * Find the tokens first, unless a stream is given (see parallel.c), or
+     * most of the input is to be taken from last time.  The stream is in
+     * the arena, so it is gone once the input is done.
+     */
+    if (ctx->tok_on && ctx->toks == NULL && !ckpt_on) {
+	ctx->toks = tok_scan(ctx, &ctx->arena, in, len);
+	own = 1;
+    }
+    ctx->tok_next = 0;
+    res->status = indent_format(ctx);
+    if (own)
+	ctx->toks = NULL;
+    out_putc(ctx, '\0');
+    res->out = out_buf;
+    res->outlen = out_ptr - out_buf - 1;
+    out_buf = out_ptr = out_limit = NULL;
+    res->diags = diag_buf;
+    res->ndiags = diag_cnt;
+    diag_buf = NULL;
+    diag_cnt = diag_max = 0;
+    in_fd = STDIN_FILENO;
+    out_fd = STDOUT_FILENO;
+    if (tmp != NULL)
+	indent_release(tmp);
+    return (res->status);
+}
+
+void
+indent_result_free(struct indent_result *res)
+{
+    size_t i;
+
+    for (i = 0; i < res->ndiags; i++)
+	free(res->diags[i].msg);
+    free(res->diags);
+    free(res->out);
+    res->out = NULL;
+    res->diags = NULL;
+    res->outlen = res->ndiags = 0;
+}
 
-    extern int  found_err;	/* flag set in diag() on error */
-    int         dec_ind;	/* current indentation for declarations */
-    int         di_stack[20];	/* a stack of structure indentation levels */
-    int         flushed_nl;	/* used when buffering up comments to remember
-				 * that a newline was passed over */
-    int         force_nl;	/* when true, code must be broken */
-    int         hd_type;	/* used to store type of stmt for if (...),
-				 * for (...), etc */
+/*
+ * Make room for n more characters at sc_end.  Text is taken from save_com
+ * while bp_save is set, and a comment can be saved then too, so buf_ptr
+ * and buf_end follow the buffer when it moves.
+ */
+static void
+save_com_reserve(struct indent_ctx *ctx, size_t n)
+{
+    size_t used, size;
+    char *nbuf;
+
+    used = sc_end != 0 ? sc_end - save_com : 0;
+    size = sc_limit - save_com;
+    if (size - used >= n)
+	return;
+    while (size - used < n)
+	size *= 2;
+    if ((nbuf = realloc(save_com, size)) == NULL)
+	err(1, NULL);
+    if (bp_save != 0) {
+	buf_ptr = nbuf + (buf_ptr - save_com);
+	buf_end = nbuf + (buf_end - save_com);
+    }
+    if (sc_end != 0)
+	sc_end = nbuf + used;
+    save_com = nbuf;
+    sc_limit = nbuf + size;
+}
+
+/*
+ * Format everything read from in_fd onto out_fd.  Returns non-zero if an
+ * error was diagnosed.
+ */
+int
+indent_format(struct indent_ctx *ctx)
+{
     int 	i;		/* local loop counter */
-    int         scase;		/* set to true when we see a case, so we will
-				 * know what to do with the following colon */
-    int         sp_sw;		/* when true, we are in the expressin of
-				 * if(...), while(...), etc. */
-    int         squest;		/* when this is positive, we have seen a ?
-				 * without the matching : in a <c>?<s>:<s>
-				 * construct */
     char 	*t_ptr;		/* used for copying tokens */
-    int         tabs_to_var;	/* true if using tabs to indent to var name */
     int         type_code;	/* the type of token, returned by lexi */
 
-    int         last_else = 0;	/* true iff last keyword was an else */
-
-    if (pledge("stdio", NULL) == -1)
-	err(1, "pledge");
-
     /*-----------------------------------------------*\
     |		      INITIALIZATION		      |
     \*-----------------------------------------------*/
 
+    ps_clear(&ps);		/* forget anything left from the last input */
+    n_real_blanklines = 0;
+    prefix_blankline_requested = postfix_blankline_requested = 0;
+    case_ind = 0;
+    code_lines = 0;
+    found_err = line_refs = 0;
+    clear_diags(ctx);
+    inhibit_formatting = suppress_blanklines = 0;
+    range_off = in_lineno = range_blanks = 0;
+    range_next = 0;
+    comment_open = paren_target = not_first_line = 0;
+    last_code = l_struct = 0;
+    ifdef_level = rparen_count = 0;
 
     hd_type = 0;
     ps.p_stack[0] = stmt;	/* this is the parser's stack */
     ps.last_nl = true;		/* this is true if the last thing scanned was
 				 * a newline */
     ps.last_token = semicolon;
-    combuf = malloc(bufsize);
-    labbuf = malloc(bufsize);
-    codebuf = malloc(bufsize);
-    tokenbuf = malloc(bufsize);
-    if (combuf == NULL || labbuf == NULL || codebuf == NULL ||
-        tokenbuf == NULL)
-	    err(1, NULL);
-    l_com = combuf + bufsize - 5;
-    l_lab = labbuf + bufsize - 5;
-    l_code = codebuf + bufsize - 5;
-    l_token = tokenbuf + bufsize - 5;
     combuf[0] = codebuf[0] = labbuf[0] = ' ';	/* set up code, label, and
 						 * comment buffers */
     combuf[1] = codebuf[1] = labbuf[1] = '\0';
@@ -101,11 +312,8 @@ main(void)
     s_code = e_code = codebuf + 1;
     s_com = e_com = combuf + 1;
     s_token = e_token = tokenbuf + 1;
+    token = token_end = s_token;
 
-    in_buffer = malloc(10);
-    if (in_buffer == NULL)
-	    err(1, NULL);
-    in_buffer_limit = in_buffer + 8;
     buf_ptr = buf_end = in_buffer;
     line_no = 1;
     had_eof = ps.in_decl = ps.decl_on_line = break_comma = false;
@@ -119,7 +327,7 @@ main(void)
     tabs_to_var = false;
 
     scase = ps.pcase = false;
-    squest = 0;
+    squest = last_else = 0;
     sc_end = 0;
     bp_save = 0;
     be_save = 0;
@@ -138,9 +346,12 @@ main(void)
 	ps.com_ind = 2;		/* dont put normal comments before column 2 */
     if (ps.decl_com_ind <= 0)	/* if not specified by user, set this */
 	ps.decl_com_ind = ps.com_ind;
-    fill_buffer();	/* get first batch of stuff into input buffer */
+    open_input(ctx);
+    if (ckpt_on && ckpt_resume(ctx))
+	goto resume;	/* pick up from a checkpoint of the last run */
+    fill_buffer(ctx);	/* get first batch of stuff into input buffer */
 
-    parse(semicolon);
+    parse(ctx, semicolon);
     {
 	char *p = buf_ptr;
 	int   col = 1;
@@ -158,6 +369,7 @@ main(void)
 	    ps.ind_level = ps.i_l_follow = col / ps.ind_size;
     }
 
+resume:
     /*
      * START OF MAIN LOOP
      */
@@ -166,7 +378,7 @@ main(void)
 				 * reach eof */
 	int         is_procname;
 
-	type_code = lexi();	/* lexi reads one token.  The actual
+	type_code = lexi(ctx);	/* lexi reads one token.  The actual
 				 * characters read are stored in "token". lexi
 				 * returns a code indicating the type of token */
 	is_procname = ps.procname[0];
@@ -206,6 +418,7 @@ main(void)
 	    case comment:	/* we have a comment, so we must copy it into
 				 * the buffer */
 		if (!flushed_nl || sc_end != 0) {
+		    save_com_reserve(ctx, 4);
 		    if (sc_end == 0) {	/* if this is the first comment, we
 					 * must set up the buffer */
 			save_com[0] = save_com[1] = ' ';
@@ -221,23 +434,34 @@ main(void)
 		    *sc_end++ = '*';
 
 		    for (;;) {	/* loop until we get to the end of the comment */
-			*sc_end = *buf_ptr++;
-			if (buf_ptr >= buf_end)
-			    fill_buffer();
+			char *star;
+			size_t n;
+
+			/* copy up to the next '*' or the end of the line */
+			star = memchr(buf_ptr, '*', buf_end - buf_ptr);
+			n = (star != NULL ? star + 1 : buf_end) - buf_ptr;
+			save_com_reserve(ctx, n + 4);
+			memmove(sc_end, buf_ptr, n);	/* may overlap if reading save_com */
+			sc_end += n;
+			buf_ptr += n;
+			if (buf_ptr >= buf_end) {
+			    if (had_eof)
+				break;
+			    fill_buffer(ctx);
+			}
 
-			if (*sc_end++ == '*' && *buf_ptr == '/')
+			if (star != NULL && *buf_ptr == '/')
 			    break;	/* we are at end of comment */
-
-			if (sc_end >= &(save_com[sc_size])) {	/* check for temp buffer
-								 * overflow */
-			    diag(1, "Internal buffer overflow - Move big comment from right after if, while, or whatever.");
-			    fflush(stdout);
-			    exit(1);
-			}
+		    }
+		    if (buf_ptr >= buf_end) {	/* ran into end of file */
+			diag(ctx, 1, "Unterminated comment");
+			ps.search_brace = false;
+			type_code = 0;
+			goto check_type;
 		    }
 		    *sc_end++ = '/';	/* add ending slash */
 		    if (++buf_ptr >= buf_end)	/* get past / in buffer */
-			fill_buffer();
+			fill_buffer(ctx);
 		    break;
 		}
 	    default:		/* it is the start of a normal statment */
@@ -255,6 +479,7 @@ main(void)
 		    ps.search_brace = false;
 		    goto check_type;
 		}
+		save_com_reserve(ctx, token_end - token + 4);
 		if (force_nl) {	/* if we should insert a nl here, put it into
 				 * the buffer */
 		    force_nl = false;
@@ -264,8 +489,8 @@ main(void)
 		    *sc_end++ = ' ';
 		    flushed_nl = false;
 		}
-		for (t_ptr = token; *t_ptr; ++t_ptr)
-		    *sc_end++ = *t_ptr;	/* copy token into temp buffer */
+		memcpy(sc_end, token, token_end - token);
+		sc_end += token_end - token;	/* copy token into temp buffer */
 		ps.procname[0] = 0;
 
 	sw_buffer:
@@ -283,7 +508,7 @@ main(void)
 	    }			/* end of switch */
 	    if (type_code != 0)	/* we must make this check, just in case there
 				 * was an unexpected EOF */
-		type_code = lexi();	/* read another token */
+		type_code = lexi(ctx);	/* read another token */
 	    is_procname = ps.procname[0];
 	}			/* end of while (search_brace) */
 	last_else = 0;
@@ -291,12 +516,13 @@ check_type:
 	if (type_code == 0) {	/* we got eof */
 	    if (s_lab != e_lab || s_code != e_code
 		    || s_com != e_com)	/* must dump end of line */
-		dump_line();
+		dump_line(ctx);
 	    if (ps.tos > 1)	/* check for balanced braces */
-		diag(1, "Missing braces at end of file.");
+		diag(ctx, 1, "Missing braces at end of file.");
 
-	    fflush(stdout);
-	    exit(found_err);
+	    out_flush(ctx);
+	    close_input(ctx);
+	    return (found_err);
 	}
 	if (
 		(type_code != comment) &&
@@ -308,7 +534,7 @@ check_type:
 		    (type_code != lbrace)) {
 		/* we should force a broken line here */
 		flushed_nl = false;
-		dump_line();
+		dump_line(ctx);
 		ps.want_blank = false;	/* dont insert blank at line start */
 		force_nl = false;
 	    }
@@ -342,21 +568,27 @@ check_type:
 
 	case form_feed:	/* found a form feed in line */
 	    ps.use_ff = true;	/* a form feed is treated much like a newline */
-	    dump_line();
+	    dump_line(ctx);
 	    ps.want_blank = false;
 	    break;
 
 	case newline:
 	    if (ps.last_token != comma || ps.p_l_follow > 0
 		    || ps.block_init || !break_comma || s_com != e_com) {
-		dump_line();
+		dump_line(ctx);
 		ps.want_blank = false;
 	    }
 	    ++line_no;		/* keep track of input line number */
+	    if ((ckpt_on && ckpt_take(ctx)) ||
+		    (ctx->par != NULL && par_take(ctx))) {
+		close_input(ctx);	/* the rest is as it was last time */
+		return (found_err);
+	    }
 	    break;
 
 	case lparen:		/* got a '(' or '[' */
 	    ++ps.p_l_follow;	/* count parens to make Healy happy */
+	    ps_grow_parens(&ps, ps.p_l_follow);
 	    if (ps.want_blank && *token != '[' &&
 		    (ps.last_token != ident
 	      || (ps.its_a_keyword && !ps.sizeof_keyword)))
@@ -379,24 +611,24 @@ check_type:
 		 * aligned right if proc decl has an explicit type on it, i.e.
 		 * "int a(x) {..."
 		 */
-		parse(semicolon);	/* I said this was a kluge... */
+		parse(ctx, semicolon);	/* I said this was a kluge... */
 		ps.in_or_st = false;	/* turn off flag for structure decl or
 					 * initialization */
 	    }
 	    if (ps.sizeof_keyword)
-		ps.sizeof_mask |= 1 << ps.p_l_follow;
+		ps.sizeof_mask |= PAREN_BIT(ps.p_l_follow);
 	    break;
 
 	case rparen:		/* got a ')' or ']' */
 	    rparen_count--;
-	    if (ps.cast_mask & (1 << ps.p_l_follow) & ~ps.sizeof_mask) {
+	    if (ps.cast_mask & PAREN_BIT(ps.p_l_follow) & ~ps.sizeof_mask) {
 		ps.last_u_d = true;
-		ps.cast_mask &= (1 << ps.p_l_follow) - 1;
+		ps.cast_mask &= PAREN_BIT(ps.p_l_follow) - 1;
 	    }
-	    ps.sizeof_mask &= (1 << ps.p_l_follow) - 1;
+	    ps.sizeof_mask &= PAREN_BIT(ps.p_l_follow) - 1;
 	    if (--ps.p_l_follow < 0) {
 		ps.p_l_follow = 0;
-		diag(0, "Extra %c", *token);
+		diag(ctx, 0, "Extra %c", *token);
 	    }
 	    if (e_code == s_code)	/* if the paren starts the line */
 		ps.paren_level = ps.p_l_follow;	/* then indent it */
@@ -413,7 +645,7 @@ check_type:
 		ps.in_stmt = false;	/* dont use stmt continuation
 					 * indentation */
 
-		parse(hd_type);	/* let parser worry about if, or whatever */
+		parse(ctx, hd_type);	/* let parser worry about if, or whatever */
 	    }
 	    ps.search_brace = true;	/* this should insure that constructs
 					 * such as main(){...} and int[]{...}
@@ -541,12 +773,12 @@ check_type:
 		 * stmt.  It is a bit complicated, because the semicolon might
 		 * be in a for stmt
 		 */
-		diag(1, "Unbalanced parens");
+		diag(ctx, 1, "Unbalanced parens");
 		ps.p_l_follow = 0;
 		if (sp_sw) {	/* this is a check for a if, while, etc. with
 				 * unbalanced parens */
 		    sp_sw = false;
-		    parse(hd_type);	/* dont lose the if, or whatever */
+		    parse(ctx, hd_type);	/* dont lose the if, or whatever */
 		}
 	    }
 	    *e_code++ = ';';
@@ -555,7 +787,7 @@ check_type:
 						 * middle of a stmt */
 
 	    if (!sp_sw) {	/* if not if for (;;) */
-		parse(semicolon);	/* let parser know about end of stmt */
+		parse(ctx, semicolon);	/* let parser know about end of stmt */
 		force_nl = true;/* force newline after a end of stmt */
 	    }
 	    break;
@@ -573,7 +805,7 @@ check_type:
 	    if (s_code != e_code && !ps.block_init) {
 		if (ps.in_parameter_declaration && !ps.in_or_st) {
 		    ps.i_l_follow = 0;
-		    dump_line();
+		    dump_line(ctx);
 		    ps.want_blank = false;
 		}
 	    }
@@ -582,11 +814,11 @@ check_type:
 
 	    if (ps.p_l_follow > 0) {	/* check for preceding unbalanced
 					 * parens */
-		diag(1, "Unbalanced parens");
+		diag(ctx, 1, "Unbalanced parens");
 		ps.p_l_follow = 0;
 		if (sp_sw) {	/* check for unclosed if, for, etc. */
 		    sp_sw = false;
-		    parse(hd_type);
+		    parse(ctx, hd_type);
 		    ps.ind_level = ps.i_l_follow;
 		}
 	    }
@@ -595,6 +827,15 @@ check_type:
 					 * with '{' */
 	    if (ps.in_decl && ps.in_or_st) {	/* this is either a structure
 						 * declaration or an init */
+		if (ps.dec_nest >= di_size) {
+		    int *nd;
+
+		    nd = reallocarray(di_stack, di_size * 2, sizeof *nd);
+		    if (nd == NULL)
+			err(1, NULL);
+		    di_stack = nd;
+		    di_size *= 2;
+		}
 		di_stack[ps.dec_nest++] = dec_ind;
 		/* ?		dec_ind = 0; */
 	    }
@@ -603,7 +844,7 @@ check_type:
 		ps.in_parameter_declaration = 0;
 	    }
 	    dec_ind = 0;
-	    parse(lbrace);	/* let parser know about this */
+	    parse(ctx, lbrace);	/* let parser know about this */
 	    if (ps.want_blank)	/* put a blank before '{' if '{' is not at
 				 * start of line */
 		*e_code++ = ' ';
@@ -616,9 +857,9 @@ check_type:
 	    if (ps.p_stack[ps.tos] == decl && !ps.block_init)	/* semicolons can be
 								 * omitted in
 								 * declarations */
-		parse(semicolon);
+		parse(ctx, semicolon);
 	    if (ps.p_l_follow) {/* check for unclosed if, for, else. */
-		diag(1, "Unbalanced parens");
+		diag(ctx, 1, "Unbalanced parens");
 		ps.p_l_follow = 0;
 		sp_sw = false;
 	    }
@@ -626,7 +867,7 @@ check_type:
 	    ps.block_init_level--;
 	    if (s_code != e_code && !ps.block_init) {	/* '}' must be first on
 							 * line */
-		dump_line();
+		dump_line(ctx);
 	    }
 	    *e_code++ = '}';
 	    ps.want_blank = true;
@@ -639,7 +880,7 @@ check_type:
 		ps.in_decl = true;
 	    }
 	    prefix_blankline_requested = 0;
-	    parse(rbrace);	/* let parser know about this */
+	    parse(ctx, rbrace);	/* let parser know about this */
 	    ps.search_brace = ps.p_stack[ps.tos] == ifhead
 		&& ps.il[ps.tos] >= ps.ind_level;
 	    break;
@@ -665,31 +906,31 @@ check_type:
 	    ps.in_stmt = false;
 	    if (*token == 'e') {
 		if (e_code != s_code && e_code[-1] != '}') {
-		    dump_line();/* make sure this starts a line */
+		    dump_line(ctx);/* make sure this starts a line */
 		    ps.want_blank = false;
 		}
 		force_nl = true;/* also, following stuff must go onto new line */
 		last_else = 1;
-		parse(elselit);
+		parse(ctx, elselit);
 	    }
 	    else {
 		if (e_code != s_code) {	/* make sure this starts a line */
-		    dump_line();
+		    dump_line(ctx);
 		    ps.want_blank = false;
 		}
 		force_nl = true;/* also, following stuff must go onto new line */
 		last_else = 0;
-		parse(dolit);
+		parse(ctx, dolit);
 	    }
 	    goto copy_id;	/* move the token into line */
 
 	case decl:		/* we have a declaration type (int, register,
 				 * etc.) */
-	    parse(decl);	/* let parser worry about indentation */
+	    parse(ctx, decl);	/* let parser worry about indentation */
 	    if (ps.last_token == rparen && ps.tos <= 1) {
 		ps.in_parameter_declaration = 1;
 		if (s_code != e_code) {
-		    dump_line();
+		    dump_line(ctx);
 		    ps.want_blank = 0;
 		}
 	    }
@@ -703,7 +944,7 @@ check_type:
 	    if ( /* !ps.in_or_st && */ ps.dec_nest <= 0)
 		ps.just_saw_decl = 2;
 	    prefix_blankline_requested = 0;
-	    for (i = 0; token[i++];);	/* get length of token */
+	    i = token_end - token + 1;	/* get length of token */
 
 	    /*
 	     * dec_ind = e_code - s_code + (ps.decl_indent>i ? ps.decl_indent
@@ -760,7 +1001,7 @@ check_type:
 		}
 		else {
 		    if (dec_ind && s_code != e_code)
-			dump_line();
+			dump_line(ctx);
 		    dec_ind = 0;
 		    ps.want_blank = false;
 		}
@@ -770,16 +1011,16 @@ check_type:
 		force_nl = true;
 		ps.last_u_d = true;
 		ps.in_stmt = false;
-		parse(hd_type);
+		parse(ctx, hd_type);
 	    }
     copy_id:
 	    if (ps.want_blank)
 		*e_code++ = ' ';
 
-	    for (t_ptr = token; *t_ptr; ++t_ptr) {
-		CHECK_SIZE_CODE;
-		*e_code++ = *t_ptr;
-	    }
+	    if (l_code - e_code < token_end - token)
+		grow_buf(&ctx->code, token_end - token);
+	    memcpy(e_code, token, token_end - token);
+	    e_code += token_end - token;
 
 	    ps.want_blank = true;
 	    break;
@@ -804,7 +1045,7 @@ check_type:
 	    if (ps.p_l_follow == 0) {
 		if (ps.block_init_level <= 0)
 		    ps.block_init = 0;
-		if (break_comma && (compute_code_target() + (e_code - s_code) > max_col - 8))
+		if (break_comma && (compute_code_target(ctx) + (e_code - s_code) > max_col - 8))
 		    force_nl = true;
 	    }
 	    break;
@@ -813,7 +1054,7 @@ check_type:
 	    if ((s_com != e_com) ||
 		    (s_lab != e_lab) ||
 		    (s_code != e_code))
-		dump_line();
+		dump_line(ctx);
 	    *e_lab++ = '#';	/* move whole line to 'label' buffer */
 	    {
 		int         in_comment = 0;
@@ -824,19 +1065,20 @@ check_type:
 		while (*buf_ptr == ' ' || *buf_ptr == '\t') {
 		    buf_ptr++;
 		    if (buf_ptr >= buf_end)
-			fill_buffer();
+			fill_buffer(ctx);
 		}
+		range_hold++;	/* and so is a preprocessor line */
 		while (*buf_ptr != '\n' || (in_comment && !had_eof)) {
 		    CHECK_SIZE_LAB;
 		    *e_lab = *buf_ptr++;
 		    if (buf_ptr >= buf_end)
-			fill_buffer();
+			fill_buffer(ctx);
 		    switch (*e_lab++) {
 		    case BACKSLASH:
 			if (!in_comment) {
 			    *e_lab++ = *buf_ptr++;
 			    if (buf_ptr >= buf_end)
-				fill_buffer();
+				fill_buffer(ctx);
 			}
 			break;
 		    case '/':
@@ -863,11 +1105,13 @@ check_type:
 			break;
 		    }
 		}
+		range_hold--;
 
 		while (e_lab > s_lab && (e_lab[-1] == ' ' || e_lab[-1] == '\t'))
 		    e_lab--;
 		if (e_lab - s_lab == com_end && bp_save == 0) {	/* comment on
 								 * preprocessor line */
+		    save_com_reserve(ctx, com_end - com_start + 3);
 		    if (sc_end == 0)	/* if this is the first comment, we
 					 * must set up the buffer */
 			sc_end = &(save_com[0]);
@@ -879,8 +1123,6 @@ check_type:
 		    }
 		    bcopy(s_lab + com_start, sc_end, com_end - com_start);
 		    sc_end += com_end - com_start;
-		    if (sc_end >= &save_com[sc_size])
-			abort();
 		    e_lab = s_lab + com_start;
 		    while (e_lab > s_lab && (e_lab[-1] == ' ' || e_lab[-1] == '\t'))
 			e_lab--;
@@ -898,23 +1140,29 @@ check_type:
 	    }
 
 	    if (strncmp(s_lab, "#if", 3) == 0) {
-		if (ifdef_level < sizeof state_stack / sizeof state_stack[0]) {
-		    match_state[ifdef_level].tos = -1;
-		    state_stack[ifdef_level++] = ps;
+		if (ifdef_level >= state_size) {
+		    int nsize = state_size ? state_size * 2 : 8;
+		    struct parser_state *nstack;
+
+		    nstack = reallocarray(state_stack, nsize, sizeof *nstack);
+		    if (nstack == NULL)
+			err(1, NULL);
+		    memset(nstack + state_size, 0,
+			(nsize - state_size) * sizeof *nstack);
+		    state_stack = nstack;
+		    state_size = nsize;
 		}
-		else
-		    diag(1, "#if stack overflow");
+		ps_copy(&state_stack[ifdef_level++], &ps);
 	    }
 	    else if (strncmp(s_lab, "#else", 5) == 0)
 		if (ifdef_level <= 0)
-		    diag(1, "Unmatched #else");
+		    diag(ctx, 1, "Unmatched #else");
 		else {
-		    match_state[ifdef_level - 1] = ps;
-		    ps = state_stack[ifdef_level - 1];
+		    ps_copy(&ps, &state_stack[ifdef_level - 1]);
 		}
 	    else if (strncmp(s_lab, "#endif", 6) == 0) {
 		if (ifdef_level <= 0)
-		    diag(1, "Unmatched #endif");
+		    diag(ctx, 1, "Unmatched #endif");
 		else {
 		    ifdef_level--;
 		}
@@ -925,11 +1173,13 @@ check_type:
 	case comment:		/* we have gotten a comment this is a biggie */
 	    if (flushed_nl) {	/* we should force a broken line here */
 		flushed_nl = false;
-		dump_line();
+		dump_line(ctx);
 		ps.want_blank = false;	/* dont insert blank at line start */
 		force_nl = false;
 	    }
-	    pr_comment();
+	    range_hold++;	/* a comment is formatted or copied whole */
+	    pr_comment(ctx);
+	    range_hold--;
 	    break;
 	}			/* end of big switch stmt */
 
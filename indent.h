@@ -0,0 +1,152 @@
+/*
+ * Interface to the formatter as a library.
+ *
+ * A context holds the buffers and tables the formatter needs.  It can be
+ * used for any number of inputs, one after another, and separate contexts
+ * can be used from separate threads.  Running out of memory is fatal, as it
+ * is for the indent program.
+ */
+
+#ifndef INDENT_H
+#define INDENT_H
+
+#include <stddef.h>
+
+struct indent_ctx;
+
+struct indent_diag {
+    int         line;		/* input line the message is about */
+    int         level;		/* 0 for a warning, 1 for an error */
+    char       *msg;
+};
+
+struct indent_result {
+    char       *out;		/* formatted text, NUL terminated */
+    size_t      outlen;		/* ... and its length */
+    struct indent_diag *diags;	/* diagnostics, in order */
+    size_t      ndiags;
+    int         status;		/* non-zero if an error was diagnosed */
+};
+
+struct indent_range {
+    int         first;		/* first input line, counting from 1 */
+    int         last;		/* last input line, inclusive */
+};
+
+struct indent_ctx *indent_alloc(void);
+void indent_release(struct indent_ctx *);
+
+/*
+ * Format only the input lines in the given ranges; the other lines are
+ * copied to the output unchanged.  The whole input is still parsed, so the
+ * lines in a range are indented as they would be if everything were
+ * formatted.  The ranges stay in effect for every later input until they
+ * are set again; no ranges means format everything.
+ */
+void indent_set_ranges(struct indent_ctx *, const struct indent_range *,
+	size_t);
+
+/*
+ * With on non-zero, find the names, numbers and literals of each input
+ * given to indent_buffer or indent_parallel in a pass of their own before
+ * formatting it, and take them from there instead of scanning them again
+ * while formatting.  Off by default, as lexi scans them about as fast as
+ * the pass does; see tokens.c.
+ */
+void indent_set_tokens(struct indent_ctx *, int);
+
+/*
+ * Format everything read from infd onto outfd.  Returns non-zero if an
+ * error was diagnosed, or -1 with errno set if reading or writing failed.
+ */
+int indent_file(struct indent_ctx *, int, int);
+
+/*
+ * As indent_file, but with reading and writing done on threads of their
+ * own, so that they overlap with formatting.  Worth it for long streams
+ * from a pipe; see pipe.c.
+ */
+int indent_pipe(struct indent_ctx *, int, int);
+
+/*
+ * Check whether what is read from infd is formatted already, without
+ * writing anything.  Each line is compared with the input as soon as it is
+ * laid out, and the check stops at the first one that differs.  Returns 0
+ * if the input is formatted, or else the number of the first line that
+ * differs, or -1 with errno set if reading failed.
+ */
+int indent_check(struct indent_ctx *, int);
+
+/*
+ * Format the len bytes at in into res, which must be released with
+ * indent_result_free.  If ctx is NULL a context is allocated just for this
+ * call.  Returns res->status.
+ */
+int indent_buffer(struct indent_ctx *, const char *, size_t,
+	struct indent_result *);
+void indent_result_free(struct indent_result *);
+
+/*
+ * As indent_buffer, for an input that is an edited version of the last one
+ * given to ctx, which must not be NULL.  Formatting starts at the last top
+ * level line before the first change and stops once the state is back to
+ * what it was last time, taking the rest of the output from last time.
+ * The result is the same as from indent_buffer.
+ */
+int indent_reformat(struct indent_ctx *, const char *, size_t,
+	struct indent_result *);
+
+/*
+ * As indent_buffer, for a large input: pieces of it are formatted on up to
+ * nthreads threads at once and joined where the state agrees.  The result
+ * is the same as from indent_buffer.
+ */
+int indent_parallel(struct indent_ctx *, const char *, size_t, int,
+	struct indent_result *);
+
+/*
+ * As indent_buffer, but res->out is a unified diff of the input against
+ * the formatted text, with name in its header, instead of the text itself.
+ * The diff is empty if the input is formatted already.
+ */
+int indent_diff(struct indent_ctx *, const char *, const char *, size_t,
+	struct indent_result *);
+
+/*
+ * As indent_buffer, but res->out is a JSON list of the edits that turn the
+ * input into the formatted text, each replacing a range of input bytes
+ * with a string, or with bytes in base64 where they are not UTF-8; "[]"
+ * if the input is formatted already.  See diff.c.
+ */
+int indent_edits(struct indent_ctx *, const char *, size_t,
+	struct indent_result *);
+
+/*
+ * Format each of the npaths files using nthreads threads, in place or into
+ * the same relative path under outdir, which must not be absolute or
+ * contain "..".  If cachedir is not NULL, results
+ * are kept in a cache there and a file seen before is not formatted again.
+ * In mode INDENT_CHECK nothing is written, and each file is only checked as
+ * with indent_check; INDENT_DIFF does the same and prints a diff of each
+ * file that would change to stdout, as indent_diff makes it.  A status line
+ * for each file goes to stderr.  Returns 1 if any file failed, else 2 if
+ * any file is not formatted, else 0.
+ */
+#define INDENT_CHECK	1
+#define INDENT_DIFF	2
+int indent_batch(char **, size_t, int, const char *, const char *, int);
+
+/*
+ * Serve framed format requests from infd, answering on outfd, until end of
+ * file; or do the same for each connection to a unix socket at path.  A
+ * socket already at path is replaced, but anything else there is an error
+ * (EEXIST).  In mode INDENT_EDITS the answer is the list of edits
+ * indent_edits makes instead of the formatted text.  A request that is too
+ * long ends its connection, not the server.  See server.c for the framing
+ * and the limit.
+ */
+#define INDENT_EDITS	3
+int indent_serve(struct indent_ctx *, int, int, int);
+int indent_serve_socket(struct indent_ctx *, const char *, int);
+
+#endif /* INDENT_H */
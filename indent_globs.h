@@ -33,9 +33,14 @@
  *	from: @(#)indent_globs.h	8.1 (Berkeley) 6/6/93
  */
 
+#include <sys/types.h>
+#include <stdint.h>
+#include "indent.h"
+#include "arena.h"
+
 #define BACKSLASH '\\'
 #define bufsize 200		/* size of internal buffers */
-#define sc_size 5000		/* size of save_com buffer */
+#define sc_size 5000		/* initial size of save_com buffer */
 #define label_offset 2		/* number of levels a label is placed to left
 				 * of code */
 
@@ -48,119 +53,45 @@
 #define true  1
 
 #define CHECK_SIZE_CODE \
-	if (e_code >= l_code) { \
-	    int nsize = l_code-s_code+400; \
-	\
-	    codebuf = realloc(codebuf, nsize); \
-	    if (codebuf == NULL) \
-		    err(1, NULL); \
-	    e_code = codebuf + (e_code-s_code) + 1; \
-	    l_code = codebuf + nsize - 5; \
-	    s_code = codebuf + 1; \
-	}
+	if (e_code >= l_code) \
+	    grow_buf(&ctx->code, 1)
 #define CHECK_SIZE_COM \
-	if (e_com >= l_com) { \
-	    int nsize = l_com-s_com+400; \
-	\
-	    combuf = realloc(combuf, nsize); \
-	    if (combuf == NULL) \
-		    err(1, NULL); \
-	    e_com = combuf + (e_com-s_com) + 1; \
-	    l_com = combuf + nsize - 5; \
-	    s_com = combuf + 1; \
-	}
+	if (e_com >= l_com) \
+	    grow_buf(&ctx->com, 1)
 #define CHECK_SIZE_LAB \
-	if (e_lab >= l_lab) { \
-	    int nsize = l_lab-s_lab+400; \
-	\
-	    labbuf = realloc(labbuf, nsize); \
-	    if (labbuf == NULL) \
-		    err(1, NULL); \
-	    e_lab = labbuf + (e_lab-s_lab) + 1; \
-	    l_lab = labbuf + nsize - 5; \
-	    s_lab = labbuf + 1; \
-	}
+	if (e_lab >= l_lab) \
+	    grow_buf(&ctx->lab, 1)
 #define CHECK_SIZE_TOKEN \
-	if (e_token >= l_token) { \
-	    int nsize = l_token-s_token+400; \
-	\
-	    tokenbuf = realloc(tokenbuf, nsize); \
-	    if (tokenbuf == NULL) \
-		    err(1, NULL); \
-	    e_token = tokenbuf + (e_token-s_token) + 1; \
-	    l_token = tokenbuf + nsize - 5; \
-	    s_token = tokenbuf + 1; \
-	}
-
-char       *labbuf;		/* buffer for label */
-char       *s_lab;		/* start ... */
-char       *e_lab;		/* .. and end of stored label */
-char       *l_lab;		/* limit of label buffer */
-
-char       *codebuf;		/* buffer for code section */
-char       *s_code;		/* start ... */
-char       *e_code;		/* .. and end of stored code */
-char       *l_code;		/* limit of code section */
-
-char       *combuf;		/* buffer for comments */
-char       *s_com;		/* start ... */
-char       *e_com;		/* ... and end of stored comments */
-char       *l_com;		/* limit of comment buffer */
-
-#define token s_token
-char       *tokenbuf;		/* the last token scanned */
-char	   *s_token;
-char       *e_token;
-char	   *l_token;
-
-char       *in_buffer;		/* input buffer */
-char	   *in_buffer_limit;	/* the end of the input buffer */
-char       *buf_ptr;		/* ptr to next character to be taken from
-				 * in_buffer */
-char       *buf_end;		/* ptr to first after last char in in_buffer */
-
-char        save_com[sc_size];	/* input text is saved here when looking for
-				 * the brace after an if, while, etc */
-char       *sc_end;		/* pointer into save_com buffer */
-
-char       *bp_save;		/* saved value of buf_ptr when taking input
-				 * from save_com */
-char       *be_save;		/* similarly saved value of buf_end */
-
-
-int         n_real_blanklines;
-int         prefix_blankline_requested;
-int         postfix_blankline_requested;
-int         break_comma;	/* when true and not in parens, break after a
-				 * comma */
-float       case_ind;		/* indentation level to be used for a "case
-				 * n:" */
-int         code_lines;		/* count of lines with code */
-int         had_eof;		/* set to true when input is exhausted */
-int         line_no;		/* the current line number. */
+	if (e_token >= l_token) \
+	    grow_buf(&ctx->tok, 1)
 
 #define max_col	78		/* the maximum allowable line length */
 
-int         inhibit_formatting;	/* true if INDENT OFF is in effect */
-int         suppress_blanklines;/* set iff following blanklines should be
-				 * suppressed */
+#define STACKSIZE 32		/* initial depth of the parser stacks */
+#define PARENSIZE 16		/* initial depth of paren_indents */
 
-/* -troff font state information */
-
-#define STACKSIZE 150
+/*
+ * The bit of cast_mask and sizeof_mask for the parens at depth d.  Parens
+ * nest deeper than an int has bits for, so those past MASKDEPTH have none:
+ * a cast or sizeof that deep is not told apart from other parens.
+ */
+#define MASKDEPTH 31
+#define PAREN_BIT(d) ((d) < MASKDEPTH ? 1 << (d) : 0)
 
 struct parser_state {
     int         last_token;
-    int         p_stack[STACKSIZE];	/* this is the parsers stack */
-    int         il[STACKSIZE];	/* this stack stores indentation levels */
-    float       cstk[STACKSIZE];/* used to store case stmt indentation levels */
+    int        *p_stack;	/* this is the parsers stack */
+    int        *il;		/* this stack stores indentation levels */
+    float      *cstk;		/* used to store case stmt indentation levels */
+    int         stacksize;	/* entries in each of the three, which share
+				 * one allocation */
     int         box_com;	/* set to true when we are in a "boxed"
 				 * comment. In that case, the first non-blank
 				 * char should be lined up with the / in rem */
     int         comment_delta,
                 n_comment_delta;
     int         cast_mask;	/* indicates which close parens close off
-				 * casts */
+				 * casts; see PAREN_BIT */
     int         sizeof_mask;	/* indicates which close parens close off
 				 * sizeof''s */
     int         block_init;	/* true iff inside a block initialization */
@@ -208,7 +139,8 @@ struct parser_state {
 				 * statement */
     int         paren_level;	/* parenthesization level. used to indent
 				 * within stmts */
-    short       paren_indents[20];	/* column positions of each paren */
+    short      *paren_indents;	/* column positions of each paren */
+    int         paren_size;	/* entries in paren_indents */
     int         pcase;		/* set to 1 if the current line label is a
 				 * case.  It is printed differently from a
 				 * regular label */
@@ -234,23 +166,335 @@ struct parser_state {
     int         tos;		/* pointer to top of stack */
     char        procname[100];	/* The name of the current procedure */
     int         just_saw_decl;
-}           ps;
+};
 
-int         ifdef_level;
-int	    rparen_count;
-struct parser_state state_stack[5];
-struct parser_state match_state[5];
+/*
+ * A buffer for one section of the output line, or for the token.  The text
+ * runs from s, one byte into the allocation, to e.  l stops five bytes short
+ * of the end of the allocation, so a few characters can always be stored
+ * after a size check.  The size doubles whenever the buffer has to grow,
+ * and a buffer keeps its largest size for later lines and inputs.
+ */
+struct growbuf {
+    char       *buf;
+    char       *s;		/* start ... */
+    char       *e;		/* ... and end of stored text */
+    char       *l;		/* limit */
+    size_t      size;		/* size of buf */
+};
+
+struct reformat;
+
+/*
+ * The names, numbers and literals found in an input before formatting it,
+ * each kept as where it starts in the input, its length, and its kind: the
+ * keyword type of a name as given by keyword(), or TOK_LIT.  See tokens.c.
+ */
+#define TOK_LIT		(-2)
 
-int compute_code_target(void);
-int compute_label_target(void);
+struct tokens {
+    const char *base;		/* the input */
+    const char *end;		/* ... up to its last newline */
+    uint32_t   *off;
+    uint32_t   *len;
+    uint32_t   *line;		/* from 1 */
+    signed char *kind;
+    char       *col_1;		/* starts a line */
+    size_t      n;
+    size_t      size;
+};
+
+struct templ {
+    const char *rwd;
+    int         rwcode;
+};
+
+/*
+ * The state of a formatting run that is kept neither in the parser state
+ * nor in the buffers.  It holds no pointers, so that a checkpoint can copy
+ * and compare it whole.
+ */
+struct fmt_state {
+    int         n_real_blanklines;
+    int         prefix_blankline_requested;
+    int         postfix_blankline_requested;
+    int         break_comma;	/* when true and not in parens, break after a
+				 * comma */
+    float       case_ind;	/* indentation level to be used for a "case
+				 * n:" */
+    int         suppress_blanklines;	/* set iff following blanklines
+					 * should be suppressed */
+    int         comment_open;
+    int         paren_target;
+    int         not_first_line;	/* set once dump_line has printed a line */
+    int         last_code;	/* the last token type returned by lexi */
+    int         l_struct;	/* set to 1 if the last token was 'struct' */
+    int         rparen_count;
+
+    int         dec_ind;	/* current indentation for declarations */
+    int         flushed_nl;	/* used when buffering up comments to remember
+				 * that a newline was passed over */
+    int         force_nl;	/* when true, code must be broken */
+    int         hd_type;	/* used to store type of stmt for if (...),
+				 * for (...), etc */
+    int         scase;		/* set to true when we see a case, so we will
+				 * know what to do with the following colon */
+    int         sp_sw;		/* when true, we are in the expressin of
+				 * if(...), while(...), etc. */
+    int         squest;		/* when this is positive, we have seen a ?
+				 * without the matching : in a <c>?<s>:<s>
+				 * construct */
+    int         tabs_to_var;	/* true if using tabs to indent to var name */
+    int         last_else;	/* true iff last keyword was an else */
+};
+
+/*
+ * All the state of one formatting run.  Every routine takes the context it
+ * works on as its "ctx" argument, and the names below are mapped onto that
+ * context, so that several inputs can be formatted in one process, one per
+ * context.
+ */
+struct indent_ctx {
+    struct growbuf lab;		/* buffer for label */
+    struct growbuf code;	/* buffer for code section */
+    struct growbuf com;		/* buffer for comments */
+    struct growbuf tok;		/* the last token scanned, if copied */
+    char       *tok_s;		/* the last token, in tok or left in the
+				 * input by lexi ... */
+    char       *tok_e;		/* ... and its end */
+
+    char       *in_buffer;	/* input buffer */
+    char       *in_buffer_limit;/* the end of the input buffer */
+    char       *buf_ptr;	/* ptr to next character to be taken from
+				 * in_buffer */
+    char       *buf_end;	/* ptr to first after last char in in_buffer */
+    char       *in_line;	/* start of the current input line, in
+				 * in_buffer or in the mapped input */
+
+    char       *save_com;	/* input text is saved here when
+				 * looking for the brace after an if,
+				 * while, etc */
+    char       *sc_end;		/* pointer into save_com buffer */
+    char       *sc_limit;	/* end of save_com buffer */
+
+    char       *bp_save;	/* saved value of buf_ptr when taking input
+				 * from save_com */
+    char       *be_save;	/* similarly saved value of buf_end */
+
+    int         in_fd;		/* input file descriptor */
+    char       *rd_buf;		/* input block buffer */
+    char       *rd_ptr;		/* next unconsumed byte in rd_buf */
+    char       *rd_end;		/* end of valid data in rd_buf */
+    char       *map_base;	/* mapped input, if any */
+    size_t      map_len;	/* ... its length */
+    char       *map_ptr;	/* next unconsumed byte of the mapped input */
+    char       *map_end;	/* end of the mapped input */
+
+    int         chk_on;		/* compare the output with the input
+				 * instead of writing it */
+    int         chk_line;	/* the first line that differs, or 0 */
+    const char *chk_base;	/* the whole input */
+    const char *chk_ptr;	/* ... the part not compared yet */
+    const char *chk_end;
+    char       *chk_buf;	/* the input, if it could not be mapped */
+
+    int         out_fd;		/* output file descriptor */
+    char       *out_buf;	/* output buffer */
+    char       *out_ptr;	/* next free byte in out_buf */
+    char       *out_limit;	/* end of out_buf */
+    int         io_err;		/* errno of the first read or write that
+				 * failed, or 0; the rest is dropped */
+
+    struct indent_diag *diag_buf;	/* messages from diag() */
+    size_t      diag_cnt;
+    size_t      diag_max;
+
+    int         code_lines;	/* count of lines with code */
+    int         had_eof;	/* set to true when input is exhausted */
+    int         line_no;	/* the current line number. */
+    int         found_err;	/* flag set in diag() on error */
+    int         line_refs;	/* line numbers written into the output */
+
+    int         inhibit_formatting;	/* true if INDENT OFF is in effect */
+    struct indent_range *ranges;	/* lines to format, sorted, or none
+					 * to format them all */
+    size_t      nranges;
+    size_t      range_next;	/* first range not yet passed */
+    int         range_off;	/* the current line is outside the ranges */
+    int         in_lineno;	/* lines read by fill_buffer */
+    int         range_blanks;	/* blank lines just read */
+    int         range_hold;	/* set while in a comment or preprocessor
+				 * line, which is not split between ranges */
+    unsigned long ntokens;	/* tokens read by lexi, never reset */
+    struct templ *usrkw;	/* keywords added by addkey, hashed */
+    unsigned int usrkw_n;	/* entries in use */
+    unsigned int usrkw_size;	/* slots, a power of two */
+
+    struct parser_state ps;
+    struct fmt_state st;
+    int        *di_stack;	/* a stack of structure indentation levels */
+    int         di_size;	/* entries in di_stack */
+    int         ifdef_level;
+    struct parser_state *state_stack;	/* state at each open #if, restored
+					 * at its #else */
+    int         state_size;	/* entries in state_stack */
+
+    struct reformat *rf;	/* the last input formatted by
+				 * indent_reformat, for the next one */
+    int         ckpt_on;	/* take checkpoints for indent_reformat */
+    struct par *par;		/* the chunks to join when formatting in
+				 * parallel, or NULL */
+    int         tok_on;		/* make a token stream for each input */
+    struct tokens *toks;	/* the tokens of the input, or NULL */
+    size_t      tok_next;	/* the token after the last one lexi took */
+    struct pipeline *pl;	/* the reader and writer threads of
+				 * indent_pipe, or NULL */
+    struct arena arena;		/* for what only lasts one input, given
+				 * back by close_input */
+};
+
+#define labbuf		(ctx->lab.buf)
+#define s_lab		(ctx->lab.s)
+#define e_lab		(ctx->lab.e)
+#define l_lab		(ctx->lab.l)
+#define codebuf		(ctx->code.buf)
+#define s_code		(ctx->code.s)
+#define e_code		(ctx->code.e)
+#define l_code		(ctx->code.l)
+#define combuf		(ctx->com.buf)
+#define s_com		(ctx->com.s)
+#define e_com		(ctx->com.e)
+#define l_com		(ctx->com.l)
+#define token		(ctx->tok_s)
+#define token_end	(ctx->tok_e)
+#define tokenbuf	(ctx->tok.buf)
+#define s_token		(ctx->tok.s)
+#define e_token		(ctx->tok.e)
+#define l_token		(ctx->tok.l)
+#define in_buffer	(ctx->in_buffer)
+#define in_buffer_limit	(ctx->in_buffer_limit)
+#define buf_ptr		(ctx->buf_ptr)
+#define buf_end		(ctx->buf_end)
+#define in_line		(ctx->in_line)
+#define save_com	(ctx->save_com)
+#define sc_end		(ctx->sc_end)
+#define sc_limit	(ctx->sc_limit)
+#define bp_save		(ctx->bp_save)
+#define be_save		(ctx->be_save)
+#define in_fd		(ctx->in_fd)
+#define rd_buf		(ctx->rd_buf)
+#define rd_ptr		(ctx->rd_ptr)
+#define rd_end		(ctx->rd_end)
+#define map_base	(ctx->map_base)
+#define map_len		(ctx->map_len)
+#define map_ptr		(ctx->map_ptr)
+#define map_end		(ctx->map_end)
+#define chk_on		(ctx->chk_on)
+#define chk_line	(ctx->chk_line)
+#define chk_base	(ctx->chk_base)
+#define chk_ptr		(ctx->chk_ptr)
+#define chk_end		(ctx->chk_end)
+#define chk_buf		(ctx->chk_buf)
+#define out_fd		(ctx->out_fd)
+#define out_buf		(ctx->out_buf)
+#define out_ptr		(ctx->out_ptr)
+#define out_limit	(ctx->out_limit)
+#define io_err		(ctx->io_err)
+#define diag_buf		(ctx->diag_buf)
+#define diag_cnt		(ctx->diag_cnt)
+#define diag_max	(ctx->diag_max)
+#define code_lines	(ctx->code_lines)
+#define had_eof		(ctx->had_eof)
+#define line_no		(ctx->line_no)
+#define found_err	(ctx->found_err)
+#define line_refs	(ctx->line_refs)
+#define ckpt_on		(ctx->ckpt_on)
+#define inhibit_formatting (ctx->inhibit_formatting)
+#define ranges		(ctx->ranges)
+#define nranges		(ctx->nranges)
+#define range_next	(ctx->range_next)
+#define range_off	(ctx->range_off)
+#define in_lineno	(ctx->in_lineno)
+#define range_blanks	(ctx->range_blanks)
+#define range_hold	(ctx->range_hold)
+#define ntokens		(ctx->ntokens)
+#define usrkw		(ctx->usrkw)
+#define usrkw_n		(ctx->usrkw_n)
+#define usrkw_size	(ctx->usrkw_size)
+#define ps		(ctx->ps)
+#define n_real_blanklines (ctx->st.n_real_blanklines)
+#define prefix_blankline_requested (ctx->st.prefix_blankline_requested)
+#define postfix_blankline_requested (ctx->st.postfix_blankline_requested)
+#define break_comma	(ctx->st.break_comma)
+#define case_ind	(ctx->st.case_ind)
+#define suppress_blanklines (ctx->st.suppress_blanklines)
+#define comment_open	(ctx->st.comment_open)
+#define paren_target	(ctx->st.paren_target)
+#define not_first_line	(ctx->st.not_first_line)
+#define last_code	(ctx->st.last_code)
+#define l_struct	(ctx->st.l_struct)
+#define rparen_count	(ctx->st.rparen_count)
+#define dec_ind		(ctx->st.dec_ind)
+#define flushed_nl	(ctx->st.flushed_nl)
+#define force_nl	(ctx->st.force_nl)
+#define hd_type		(ctx->st.hd_type)
+#define scase		(ctx->st.scase)
+#define sp_sw		(ctx->st.sp_sw)
+#define squest		(ctx->st.squest)
+#define tabs_to_var	(ctx->st.tabs_to_var)
+#define last_else	(ctx->st.last_else)
+#define ifdef_level	(ctx->ifdef_level)
+#define di_stack	(ctx->di_stack)
+#define di_size		(ctx->di_size)
+#define state_stack	(ctx->state_stack)
+#define state_size	(ctx->state_size)
+
+int indent_format(struct indent_ctx *);
+
+int compute_code_target(struct indent_ctx *);
+int compute_label_target(struct indent_ctx *);
 int count_spaces(int, char *);
-void diag(int, const char *, ...) __attribute__((__format__ (printf, 2, 3)));
-void dump_line(void);
-void fill_buffer(void);
-int pad_output(int, int);
-void set_defaults(void);
-void addkey(char *, int);
-int lexi(void);
-void reduce(void);
-void parse(int);
-void pr_comment(void);
+int count_spaces_until(int, char *, char *);
+void diag(struct indent_ctx *, int, const char *, ...)
+	__attribute__((__format__ (printf, 3, 4)));
+void dump_line(struct indent_ctx *);
+struct indent_diag *new_diag(struct indent_ctx *);
+void clear_diags(struct indent_ctx *);
+void grow_buf(struct growbuf *, size_t);
+void fill_buffer(struct indent_ctx *);
+void open_input(struct indent_ctx *);
+void close_input(struct indent_ctx *);
+void out_write(struct indent_ctx *, const char *, size_t);
+void out_putc(struct indent_ctx *, int);
+void out_printf(struct indent_ctx *, const char *, ...)
+	__attribute__((__format__ (printf, 2, 3)));
+void out_flush(struct indent_ctx *);
+void addkey(struct indent_ctx *, char *, int);
+int keyword(struct indent_ctx *, const char *, size_t);
+void keywords_init(struct indent_ctx *);
+void keywords_free(struct indent_ctx *);
+int lexi(struct indent_ctx *);
+size_t scan_name(const char *);
+size_t scan_literal(const char *, const char *);
+void parse(struct indent_ctx *, int);
+void ps_grow(struct parser_state *, int);
+void ps_grow_parens(struct parser_state *, int);
+void ps_clear(struct parser_state *);
+void ps_copy(struct parser_state *, const struct parser_state *);
+int ps_same(const struct parser_state *, const struct parser_state *);
+void ps_free(struct parser_state *);
+void pr_comment(struct indent_ctx *);
+int ckpt_resume(struct indent_ctx *);
+int ckpt_top(struct indent_ctx *);
+int ckpt_take(struct indent_ctx *);
+int ckpt_join(struct indent_ctx *, struct reformat *, const char *, size_t,
+	int);
+void reformat_free(struct indent_ctx *);
+int par_take(struct indent_ctx *);
+struct tokens *tok_scan(struct indent_ctx *, struct arena *, const char *,
+	size_t);
+ssize_t pipe_fill(struct indent_ctx *);
+int pipe_flush(struct indent_ctx *);
+long tok_find(struct indent_ctx *, const char *);
+
+extern char chartype[128];
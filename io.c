@@ -33,26 +33,47 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "indent_globs.h"
 
+#define rd_size	65536		/* size of the blocks read from the input */
+#define out_size 65536		/* output is written in blocks of this size */
 
-int         comment_open;
-static int  paren_target;
+static int pad_output(struct indent_ctx *, int, int);
+
+static const char tab_run[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+static const char blank_run[] = "                                ";
+static const char nl_run[] = "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+
+static void out_repeat(struct indent_ctx *, const char *, int);
+static void out_vprintf(struct indent_ctx *, const char *, va_list);
 
 void
-dump_line(void)
+dump_line(struct indent_ctx *ctx)
 {				/* dump_line is the routine that actually
 				 * effects the printing of the new source. It
 				 * prints the label section, followed by the
 				 * code section with the appropriate nesting
 				 * level, followed by any comments */
     int         cur_col, target_col;
-    static int  not_first_line;
-
+    int         fd = out_fd;
+    size_t      mark = 0;
+
+    if (range_off) {		/* the line has been copied already: lay it
+				 * out all the same, to keep the state as it
+				 * would be, but keep the output in memory and
+				 * drop it again */
+	mark = out_ptr - out_buf;
+	out_fd = -1;
+    }
     if (ps.procname[0]) {
 	ps.ind_level = 0;
 	ps.procname[0] = 0;
@@ -72,8 +93,8 @@ dump_line(void)
 	    if (n_real_blanklines == 0)
 		n_real_blanklines = 1;
 	}
-	while (--n_real_blanklines >= 0)
-	    putchar('\n');
+	if (n_real_blanklines > 0)
+	    out_repeat(ctx, nl_run, n_real_blanklines);
 	n_real_blanklines = 0;
 	if (ps.ind_level == 0)
 	    ps.ind_stmt = 0;	/* this is a class A kludge. dont do
@@ -87,26 +108,27 @@ dump_line(void)
 	if (e_lab != s_lab) {	/* print lab, if any */
 	    if (comment_open) {
 		comment_open = 0;
-		puts(".*/");
+		out_write(ctx, ".*/\n", 4);
 	    }
 	    while (e_lab > s_lab && (e_lab[-1] == ' ' || e_lab[-1] == '\t'))
 		e_lab--;
-	    cur_col = pad_output(1, compute_label_target());
+	    cur_col = pad_output(ctx, 1, compute_label_target(ctx));
 	    if (s_lab[0] == '#' && (strncmp(s_lab, "#else", 5) == 0
 				    || strncmp(s_lab, "#endif", 6) == 0)) {
 		char *s = s_lab;
 		if (e_lab[-1] == '\n')
 			e_lab--;
 		do
-			putchar(*s++);
+			s++;
 		while (s < e_lab && 'a' <= *s && *s<='z');
+		out_write(ctx, s_lab, s - s_lab);
 		while ((*s == ' ' || *s == '\t') && s < e_lab)
 		    s++;
 		if (s < e_lab)
-		    printf(s[0]=='/' && s[1]=='*' ? "\t%.*s" : "\t/* %.*s */",
+		    out_printf(ctx, s[0]=='/' && s[1]=='*' ? "\t%.*s" : "\t/* %.*s */",
 			    (int)(e_lab - s), s);
 	    }
-	    else printf("%.*s", (int)(e_lab - s_lab), s_lab);
+	    else out_write(ctx, s_lab, strnlen(s_lab, e_lab - s_lab));
 	    cur_col = count_spaces(cur_col, s_lab);
 	}
 	else
@@ -115,13 +137,13 @@ dump_line(void)
 	ps.pcase = false;
 
 	if (s_code != e_code) {	/* print code section, if any */
-	    char *p;
+	    char *p, *q;
 
 	    if (comment_open) {
 		comment_open = 0;
-		puts(".*/");
+		out_write(ctx, ".*/\n", 4);
 	    }
-	    target_col = compute_code_target();
+	    target_col = compute_code_target(ctx);
 	    {
 		int  i;
 
@@ -129,13 +151,13 @@ dump_line(void)
 		    if (ps.paren_indents[i] >= 0)
 			ps.paren_indents[i] = -(ps.paren_indents[i] + target_col);
 	    }
-	    cur_col = pad_output(cur_col, target_col);
-	    for (p = s_code; p < e_code; p++)
-		if (*p == (char) 0200)
-		    printf("%d", target_col * 7);
-		else
-		    putchar(*p);
-	    cur_col = count_spaces(cur_col, s_code);
+	    cur_col = pad_output(ctx, cur_col, target_col);
+	    for (p = s_code; (q = memchr(p, 0200, e_code - p)) != NULL; p = q + 1) {
+		out_write(ctx, p, q - p);
+		out_printf(ctx, "%d", target_col * 7);
+	    }
+	    out_write(ctx, p, e_code - p);
+	    cur_col = count_spaces_until(cur_col, s_code, e_code);
 	}
 	if (s_com != e_com) {
 	    int   target = ps.com_col;
@@ -156,7 +178,7 @@ dump_line(void)
 
 	    if (cur_col > target) {	/* if comment cant fit on this line,
 					 * put it on next line */
-		putchar('\n');
+		out_putc(ctx, '\n');
 		cur_col = 1;
 		++ps.out_lines;
 	    }
@@ -164,25 +186,25 @@ dump_line(void)
 	    while (e_com > com_st && isspace((unsigned char)e_com[-1]))
 		e_com--;
 
-	     cur_col = pad_output(cur_col, target);
+	     cur_col = pad_output(ctx, cur_col, target);
 
 	    if (!ps.box_com) {
 		if (com_st[1] != '*' || e_com <= com_st + 1) {
 		    if (com_st[1] == ' ' && com_st[0] == ' ' && e_com > com_st + 1)
 			com_st[1] = '*';
 		    else
-			fwrite(" * ", com_st[0] == '\t' ? 2 : com_st[0] == '*' ? 1 : 3, 1, stdout);
+			out_write(ctx, " * ", com_st[0] == '\t' ? 2 : com_st[0] == '*' ? 1 : 3);
 		}
 	    }
-	    fwrite(com_st, e_com - com_st, 1, stdout);
+	    out_write(ctx, com_st, e_com - com_st);
 	    ps.comment_delta = ps.n_comment_delta;
 	    cur_col = count_spaces(cur_col, com_st);
 	    ++ps.com_lines;	/* count lines with comments */
 	}
 	if (ps.use_ff)
-	    putchar('\014');
+	    out_putc(ctx, '\014');
 	else
-	    putchar('\n');
+	    out_putc(ctx, '\n');
 	++ps.out_lines;
         prefix_blankline_requested = postfix_blankline_requested;
 	postfix_blankline_requested = 0;
@@ -202,13 +224,20 @@ dump_line(void)
     *(e_com = s_com) = '\0';
     ps.ind_level = ps.i_l_follow;
     ps.paren_level = ps.p_l_follow;
-    paren_target = -ps.paren_indents[ps.paren_level - 1];
+    paren_target = ps.paren_level > 0 ?
+	-ps.paren_indents[ps.paren_level - 1] : 0;
     not_first_line = 1;
+    if (range_off) {
+	out_ptr = out_buf + mark;
+	out_fd = fd;
+    }
+    if (chk_on)
+	out_flush(ctx);		/* stop at the first line that differs */
     return;
 }
 
 int
-compute_code_target(void)
+compute_code_target(struct indent_ctx *ctx)
 {
     int target_col;
 
@@ -232,7 +261,7 @@ compute_code_target(void)
 }
 
 int
-compute_label_target(void)
+compute_label_target(struct indent_ctx *ctx)
 {
     return
 	ps.pcase ? (int) (case_ind * ps.ind_size) + 1
@@ -241,6 +270,171 @@ compute_label_target(void)
 }
 
 
+static size_t fill_block(struct indent_ctx *);
+
+/*
+ * The number of newlines from p up to end.
+ */
+static int
+count_lines(const char *p, const char *end)
+{
+    int n = 0;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+	n++;
+	p++;
+    }
+    return (n);
+}
+
+/*
+ * Set up the input.  A regular file is mapped, and fill_buffer hands out
+ * lines straight from the mapping instead of copying them into in_buffer.
+ * Anything else is read in blocks by fill_block.  If in_fd is -1 the input
+ * is already in memory, between map_ptr and map_end, and is used the same
+ * way as a mapping.  In check mode the output is compared with the whole
+ * input, so input that cannot be mapped is read into memory first.
+ */
+void
+open_input(struct indent_ctx *ctx)
+{
+    struct stat st;
+    void *m;
+
+    rd_ptr = rd_end = rd_buf;
+    map_base = NULL;
+    if (in_fd != -1) {
+	map_ptr = map_end = NULL;
+	if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		st.st_size > 0 && st.st_size <= SIZE_MAX &&
+		(m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd,
+		0)) != MAP_FAILED) {
+	    map_base = map_ptr = m;
+	    map_len = st.st_size;
+	    map_end = map_ptr + st.st_size;
+	}
+    }
+    if (!chk_on)
+	return;
+    if (map_end == NULL) {
+	size_t len = 0, size = rd_size, n;
+
+	if ((chk_buf = arena_alloc(&ctx->arena, size)) == NULL)
+	    err(1, NULL);
+	while ((n = fill_block(ctx)) > 0) {
+	    if (size - len < n) {
+		size_t osize = size;
+
+		while (size - len < n)
+		    size *= 2;
+		if ((chk_buf = arena_grow(&ctx->arena, chk_buf, osize,
+		    size)) == NULL)
+		    err(1, NULL);
+	    }
+	    memcpy(chk_buf + len, rd_buf, n);
+	    len += n;
+	}
+	rd_ptr = rd_end = rd_buf;
+	map_ptr = chk_buf;
+	map_end = chk_buf + len;
+    }
+    chk_base = chk_ptr = map_ptr;
+    chk_end = map_end;
+    chk_line = 0;
+}
+
+/*
+ * Release whatever open_input set up, and all the input took from the
+ * arena.  In check mode, input left over after the last of the output
+ * differs too.
+ */
+void
+close_input(struct indent_ctx *ctx)
+{
+    if (chk_on && chk_line == 0 && chk_ptr != chk_end)
+	chk_line = count_lines(chk_base, chk_ptr) + 1;
+    if (map_base != NULL)
+	munmap(map_base, map_len);
+    map_base = map_ptr = map_end = NULL;
+    chk_buf = NULL;
+    arena_reset(&ctx->arena);
+}
+
+/*
+ * Read the next block of input into rd_buf.  Lines are cut out of the block
+ * by fill_buffer with memchr, so the per-character cost of stdio is paid
+ * only once per block.  Returns the number of bytes read, 0 at end of file
+ * or on an error, which is kept in io_err.
+ * In a pipeline the blocks come from its reader thread (see pipe.c).
+ */
+static size_t
+fill_block(struct indent_ctx *ctx)
+{
+    ssize_t n;
+
+    if (ctx->pl != NULL && (n = pipe_fill(ctx)) != -1)
+	return (n);
+    if (rd_buf == NULL && (rd_buf = malloc(rd_size)) == NULL)
+	err(1, NULL);
+    do
+	n = read(in_fd, rd_buf, rd_size);
+    while (n == -1 && errno == EINTR);
+    if (n == -1) {
+	if (io_err == 0)
+	    io_err = errno;
+	n = 0;			/* as if the input ended here */
+    }
+    rd_ptr = rd_buf;
+    rd_end = rd_buf + n;
+    return (n);
+}
+
+/*
+ * Work out whether the line just read is in one of the ranges to format.
+ * Crossing out of a range prints what is pending, as that came from lines
+ * in the range, along with the blank lines at the end of the range whose
+ * newlines lexi has not handed out yet; once out of the range they would
+ * only be counted.  Crossing into a range lays out what is pending without
+ * printing it, as those lines have been copied already, and starts off on
+ * an empty slate as INDENT ON does.  The blank line made up at the end of
+ * the input belongs to whatever came before it, so a range up to the end
+ * ends the input just as formatting all of it does.  A comment or a
+ * preprocessor line is not split: the range is stretched or shrunk to its
+ * end, and a range does not start between an if () and its statement.
+ */
+static void
+check_range(struct indent_ctx *ctx)
+{
+    int off, n;
+
+    if (range_hold || (range_off && ps.search_brace) ||
+	(had_eof && buf_end - in_line == 2))
+	return;
+    while (range_next < nranges && ranges[range_next].last < in_lineno)
+	range_next++;
+    off = range_next == nranges || ranges[range_next].first > in_lineno;
+    if (off == range_off)
+	return;
+    if (s_com != e_com || s_lab != e_lab || s_code != e_code) {
+	dump_line(ctx);
+	ps.want_blank = false;	/* dont insert blank at line start */
+    }
+    if (off) {
+	n = in_lineno - line_no;	/* newlines not yet seen by dump_line */
+	if (n > range_blanks)
+	    n = range_blanks;
+	out_repeat(ctx, nl_run, n_real_blanklines + (n > 0 ? n : 0));
+	n_real_blanklines = 0;
+    } else {
+	n_real_blanklines = 0;
+	postfix_blankline_requested = 0;
+	prefix_blankline_requested = 0;
+	suppress_blanklines = 1;
+	range_blanks = 0;
+    }
+    range_off = off;
+}
+
 /*
  * Copyright (C) 1976 by the Board of Trustees of the University of Illinois
  * 
@@ -249,7 +443,7 @@ compute_label_target(void)
  * 
  * NAME: fill_buffer
  * 
- * FUNCTION: Reads one block of input into input_buffer
+ * FUNCTION: Reads one line of input into input_buffer
  * 
  * HISTORY: initial coding 	November 1976	D A Willcox of CAC 1/7/77 A
  * Willcox of CAC	Added check for switch back to partly full input
@@ -257,11 +451,10 @@ compute_label_target(void)
  * 
  */
 void
-fill_buffer(void)
+fill_buffer(struct indent_ctx *ctx)
 {				/* this routine reads stuff from the input */
-    char *p, *buf2;
-    int i;
-    FILE *f = stdin;
+    char *p, *nl, *buf2;
+    size_t n;
 
     if (bp_save != 0) {		/* there is a partly filled input buffer left */
 	buf_ptr = bp_save;	/* dont read anything, just switch buffers */
@@ -271,10 +464,28 @@ fill_buffer(void)
 	    return;		/* only return if there is really something in
 				 * this buffer */
     }
+    if (map_end != NULL && (nl = memchr(map_ptr, '\n', map_end - map_ptr))) {
+	buf_ptr = map_ptr;	/* a whole line in the mapping, use it as is */
+	buf_end = p = map_ptr = nl + 1;
+	goto got_line;
+    }
     for (p = in_buffer;;) {
-	if (p >= in_buffer_limit) {
-	    int size = (in_buffer_limit - in_buffer) * 2 + 10;
-	    int offset = p - in_buffer;
+	if (map_end != NULL) {
+	    n = map_end - map_ptr;	/* unterminated last line, or eof */
+	    nl = NULL;
+	} else if (rd_ptr >= rd_end && fill_block(ctx) == 0) {
+	    n = 0;
+	    nl = NULL;
+	} else {
+	    nl = memchr(rd_ptr, '\n', rd_end - rd_ptr);
+	    n = (nl != NULL ? nl + 1 : rd_end) - rd_ptr;
+	}
+	if (p + n > in_buffer_limit) {
+	    size_t size = (in_buffer_limit - in_buffer) * 2 + 10;
+	    size_t offset = p - in_buffer;
+
+	    if (size < offset + n + 2)
+		size = offset + n + 2;
 	    buf2 = realloc(in_buffer, size);
 	    if (buf2 == NULL)
 		errx(1, "input line too long");
@@ -282,25 +493,46 @@ fill_buffer(void)
 	    p = in_buffer + offset;
 	    in_buffer_limit = in_buffer + size - 2;
 	}
-	if ((i = getc(f)) == EOF) {
+	if (n == 0) {
 		*p++ = ' ';
 		*p++ = '\n';
 		had_eof = true;
 		break;
 	}
-	*p++ = i;
-	if (i == '\n')
+	if (map_end != NULL) {
+	    memcpy(p, map_ptr, n);
+	    p += n;
+	    map_ptr += n;
+	    continue;
+	}
+	memcpy(p, rd_ptr, n);
+	p += n;
+	rd_ptr += n;
+	if (nl != NULL)
 		break;
     }
     buf_ptr = in_buffer;
     buf_end = p;
-    if (p - 3 >= in_buffer && p[-2] == '/' && p[-3] == '*') {
-	if (in_buffer[3] == 'I' && strncmp(in_buffer, "/**INDENT**", 11) == 0)
-	    fill_buffer();	/* flush indent error message */
+got_line:
+    in_line = buf_ptr;
+    in_lineno++;
+    if (nranges > 0) {
+	check_range(ctx);
+	for (p = in_line; p < buf_end && (*p == ' ' || *p == '\t'); p++)
+	    ;
+	range_blanks = *p == '\n' ? range_blanks + 1 : 0;
+	p = buf_end;
+    }
+    if (p - 3 >= in_line && p[-2] == '/' && p[-3] == '*') {
+	if (in_line[3] == 'I' && strncmp(in_line, "/**INDENT**", 11) == 0) {
+	    if (range_off)
+		out_write(ctx, in_line, buf_end - in_line);
+	    fill_buffer(ctx);	/* flush indent error message */
+	}
 	else {
 	    int         com = 0;
 
-	    p = in_buffer;
+	    p = in_line;
 	    while (*p == ' ' || *p == '\t')
 		p++;
 	    if (*p == '/' && p[1] == '*') {
@@ -324,7 +556,7 @@ fill_buffer(void)
 			p++;
 		    if (p[0] == '*' && p[1] == '/' && p[2] == '\n' && com) {
 			if (s_com != e_com || s_lab != e_lab || s_code != e_code)
-			    dump_line();
+			    dump_line(ctx);
 			if (!(inhibit_formatting = com - 1)) {
 			    n_real_blanklines = 0;
 			    postfix_blankline_requested = 0;
@@ -336,12 +568,10 @@ fill_buffer(void)
 	    }
 	}
     }
-    if (inhibit_formatting) {
-	p = in_buffer;
-	do
-	    putchar(*p);
-	while (*p++ != '\n');
-    }
+    if (inhibit_formatting)
+	out_write(ctx, in_line, buf_end - in_line);
+    else if (range_off)		/* as read, without the padding at eof */
+	out_write(ctx, in_line, buf_end - in_line - (had_eof ? 2 : 0));
     return;
 }
 
@@ -356,7 +586,8 @@ fill_buffer(void)
  * FUNCTION: Writes tabs and spaces to move the current column up to the desired
  * position.
  * 
- * ALGORITHM: Put tabs and/or blanks into pobuf, then write pobuf.
+ * ALGORITHM: Work out the number of tabs and blanks needed, then append
+ * them to the output as runs.
  * 
  * PARAMETERS: current		integer		The current column target
  *             target 		integer		The desired column
@@ -366,28 +597,29 @@ fill_buffer(void)
  * 
  * GLOBALS: None
  * 
- * CALLS: write (sys)
+ * CALLS: out_repeat
  * 
  * CALLED BY: dump_line
  * 
  * HISTORY: initial coding 	November 1976	D A Willcox of CAC
  * 
  */
-int
-pad_output(int current, int target)
+static int
+pad_output(struct indent_ctx *ctx, int current, int target)
 {
     int curr;		/* internal column pointer */
     int tcur;
+    int ntabs;
 
     if (current >= target)
 	    return (current);	/* line is already long enough */
     curr = current;
-    while ((tcur = ((curr - 1) & tabmask) + tabsize + 1) <= target) {
-	putchar('\t');
-	curr = tcur;
+    if ((tcur = ((curr - 1) & tabmask) + tabsize + 1) <= target) {
+	ntabs = 1 + (target - tcur) / tabsize;
+	out_repeat(ctx, tab_run, ntabs);
+	curr = tcur + (ntabs - 1) * tabsize;
     }
-    while (curr++ < target)
-	putchar(' ');	/* pad with final blanks */
+    out_repeat(ctx, blank_run, target - curr);	/* pad with final blanks */
     return (target);
 }
 
@@ -413,13 +645,23 @@ pad_output(int current, int target)
  */
 int
 count_spaces(int current, char *buffer)
+{
+    return (count_spaces_until(current, buffer, NULL));
+}
+
+/*
+ * Like count_spaces, but also stops at end (if not NULL), so it can be used
+ * on the input line without writing into it.
+ */
+int
+count_spaces_until(int current, char *buffer, char *end)
 {
     char *buf;		/* used to look thru buffer */
     int cur;		/* current character counter */
 
     cur = current;
 
-    for (buf = buffer; *buf != '\0'; ++buf) {
+    for (buf = buffer; buf != end && *buf != '\0'; ++buf) {
 	switch (*buf) {
 
 	case '\n':
@@ -443,18 +685,243 @@ count_spaces(int current, char *buffer)
     return (cur);
 }
 
-int	found_err;
+/*
+ * Add an entry to the list of diagnostics and return it.
+ */
+struct indent_diag *
+new_diag(struct indent_ctx *ctx)
+{
+    struct indent_diag *d;
+
+    if (diag_cnt >= diag_max) {
+	size_t nmax = diag_max ? diag_max * 2 : 8;
+
+	d = reallocarray(diag_buf, nmax, sizeof diag_buf[0]);
+	if (d == NULL)
+	    err(1, NULL);
+	diag_buf = d;
+	diag_max = nmax;
+    }
+    return (&diag_buf[diag_cnt++]);
+}
 
 void
-diag(int level, const char *msg, ...)
+diag(struct indent_ctx *ctx, int level, const char *msg, ...)
 {
     va_list ap;
 
+    va_list ap2;
+    struct indent_diag *d;
+    int n;
+
     va_start(ap, msg);
     if (level)
 	found_err = 1;
-    fprintf(stdout, "/**INDENT** %s@%d: ", level == 0 ? "Warning" : "Error", line_no);
-    vfprintf(stdout, msg, ap);
-    fprintf(stdout, " */\n");
+    line_refs++;
+    d = new_diag(ctx);
+    d->line = line_no;
+    d->level = level;
+    va_copy(ap2, ap);
+    n = vsnprintf(NULL, 0, msg, ap2);
+    va_end(ap2);
+    if (n < 0 || (d->msg = malloc(n + 1)) == NULL)
+	err(1, NULL);
+    va_copy(ap2, ap);
+    vsnprintf(d->msg, n + 1, msg, ap2);
+    va_end(ap2);
+    if (!range_off) {	/* lines outside the ranges are left as they are */
+	out_printf(ctx, "/**INDENT** %s@%d: ", level == 0 ? "Warning" : "Error", line_no);
+	out_vprintf(ctx, msg, ap);
+	out_write(ctx, " */\n", 4);
+    }
+    va_end(ap);
+}
+
+/*
+ * Make room for at least n more characters after b->e, doubling the size of
+ * the buffer as often as it takes.
+ */
+void
+grow_buf(struct growbuf *b, size_t n)
+{
+    size_t used = b->e - b->s, size = b->size;
+    char *nbuf;
+
+    if (size < bufsize)
+	size = bufsize;
+    while (size < used + n + 6)	/* s is 1 in, l is 5 short of the end */
+	size *= 2;
+    if (size == b->size)
+	return;
+    if ((nbuf = realloc(b->buf, size)) == NULL)
+	err(1, NULL);
+    b->buf = nbuf;
+    b->s = nbuf + 1;
+    b->e = b->s + used;
+    b->l = nbuf + size - 5;
+    b->size = size;
+}
+
+/*
+ * Forget the messages collected by diag.
+ */
+void
+clear_diags(struct indent_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < diag_cnt; i++)
+	free(diag_buf[i].msg);
+    diag_cnt = 0;
+}
+
+/*
+ * Output goes through a single buffer that is written to out_fd with
+ * write(2) whenever it fills up, so the cost of output is in the number of
+ * bytes and not in the number of calls.  If out_fd is -1 the buffer just
+ * grows and holds all of the output.
+ */
+
+/*
+ * Make room for at least n more bytes in the output buffer.
+ */
+static void
+out_reserve(struct indent_ctx *ctx, size_t n)
+{
+    size_t size, used;
+    char *nbuf;
+
+    if ((size_t)(out_limit - out_ptr) >= n)
+	return;
+    if (out_ptr != out_buf) {
+	out_flush(ctx);
+	if ((size_t)(out_limit - out_ptr) >= n)
+	    return;
+    }
+    used = out_ptr - out_buf;
+    size = out_limit - out_buf;
+    if (size < out_size)
+	size = out_size;
+    while (size - used < n)
+	size *= 2;
+    if ((nbuf = realloc(out_buf, size)) == NULL)
+	err(1, NULL);
+    out_buf = nbuf;
+    out_ptr = out_buf + used;
+    out_limit = out_buf + size;
+}
+
+void
+out_write(struct indent_ctx *ctx, const char *s, size_t n)
+{
+    if (n == 0)
+	return;			/* out_buf may not be there yet */
+    out_reserve(ctx, n);
+    memcpy(out_ptr, s, n);
+    out_ptr += n;
+}
+
+void
+out_putc(struct indent_ctx *ctx, int c)
+{
+    if (out_ptr >= out_limit)
+	out_reserve(ctx, 1);
+    *out_ptr++ = c;
+}
+
+/*
+ * Append n copies of the character in run, a string of identical characters.
+ */
+static void
+out_repeat(struct indent_ctx *ctx, const char *run, int n)
+{
+    int len = strlen(run);
+
+    if (n <= 0)
+	return;
+    out_reserve(ctx, n);
+    for (; n > len; n -= len, out_ptr += len)
+	memcpy(out_ptr, run, len);
+    memcpy(out_ptr, run, n);
+    out_ptr += n;
+}
+
+static void
+out_vprintf(struct indent_ctx *ctx, const char *fmt, va_list ap)
+{
+    va_list ap2;
+    int n;
+
+    va_copy(ap2, ap);
+    n = vsnprintf(out_ptr, out_limit - out_ptr, fmt, ap2);
+    va_end(ap2);
+    if (n < 0)
+	err(1, "vsnprintf");
+    if (n >= out_limit - out_ptr) {
+	out_reserve(ctx, n + 1);
+	vsnprintf(out_ptr, n + 1, fmt, ap);
+    }
+    out_ptr += n;
+}
+
+void
+out_printf(struct indent_ctx *ctx, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    out_vprintf(ctx, fmt, ap);
     va_end(ap);
 }
+
+/*
+ * In check mode, compare the output buffered so far with the input instead
+ * of writing it, and drop it.  At the first difference note the line it is
+ * on and skip the rest of the input, so that formatting ends soon after.
+ */
+static void
+check_output(struct indent_ctx *ctx)
+{
+    size_t n = out_ptr - out_buf, i;
+
+    if (chk_line == 0) {
+	if (n <= (size_t)(chk_end - chk_ptr) && memcmp(out_buf, chk_ptr, n) == 0)
+	    chk_ptr += n;
+	else {
+	    for (i = 0; chk_ptr + i < chk_end && out_buf[i] == chk_ptr[i]; i++)
+		;
+	    chk_line = count_lines(chk_base, chk_ptr + i) + 1;
+	    map_ptr = map_end;
+	}
+    }
+    out_ptr = out_buf;
+}
+
+/*
+ * Write out everything buffered so far.
+ */
+void
+out_flush(struct indent_ctx *ctx)
+{
+    char *p;
+    ssize_t n;
+
+    if (chk_on) {
+	check_output(ctx);
+	return;
+    }
+    if (out_fd == -1)
+	return;		/* output is kept in memory */
+    if (ctx->pl != NULL && pipe_flush(ctx))
+	return;
+    for (p = out_buf; io_err == 0 && p < out_ptr; p += n) {
+	if ((n = write(out_fd, p, out_ptr - p)) == -1) {
+	    if (errno == EINTR) {
+		n = 0;
+		continue;
+	    }
+	    io_err = errno;	/* and drop the rest */
+	}
+    }
+    out_ptr = out_buf;
+}
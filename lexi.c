@@ -49,45 +49,61 @@
 #define alphanum 1
 #define opchar 3
 
-struct templ {
-    char       *rwd;
-    int         rwcode;
-};
+static void skip_blanks(struct indent_ctx *);
+
+/*
+ * Whether the text at buf_ptr stays where it is until the next token is
+ * scanned, so that the token can be left in it instead of being copied to
+ * tokenbuf.  It does in a line fill_buffer took as is from the mapped
+ * input, but in_buffer and save_com are filled again.
+ */
+#define IN_PLACE	(bp_save == 0 && in_line != in_buffer)
+
+/* a byte of a name or a number; not one past ASCII, which chartype lacks */
+#define ALNUM(c)	((unsigned char)(c) < 128 && \
+			 chartype[(unsigned char)(c)] == alphanum)
 
-struct templ specialsinit[] = {
-	{ "switch", 1 },
-	{ "case", 2 },
-	{ "break", 0 },
-	{ "struct", 3 },
-	{ "union", 3 },
-	{ "enum", 3 },
-	{ "default", 2 },
-	{ "int", 4 },
-	{ "char", 4 },
-	{ "float", 4 },
-	{ "double", 4 },
-	{ "long", 4 },
-	{ "short", 4 },
-	{ "typedef", 4 },
-	{ "unsigned", 4 },
-	{ "register", 4 },
-	{ "static", 4 },
-	{ "global", 4 },
-	{ "extern", 4 },
-	{ "void", 4 },
-	{ "goto", 0 },
-	{ "return", 0 },
-	{ "if", 5 },
-	{ "while", 5 },
-	{ "for", 5 },
-	{ "else", 6 },
-	{ "do", 6 },
-	{ "sizeof", 7 },
+/*
+ * The built in keywords, each in the slot given by KW_HASH.  The hash
+ * function was picked so that no two of them share a slot, which makes the
+ * lookup a single compare; change it along with the table.
+ */
+#define KW_SIZE 64
+#define KW_HASH(s, len) \
+	(((unsigned char)(s)[0] * 14 + (unsigned char)(s)[(len) - 1] * 5 + \
+	    (len) * 5) & (KW_SIZE - 1))
+
+static const struct templ kwtab[KW_SIZE] = {
+	[0] = { "return", 0 },
+	[2] = { "unsigned", 4 },
+	[6] = { "if", 5 },
+	[10] = { "extern", 4 },
+	[12] = { "break", 0 },
+	[15] = { "double", 4 },
+	[17] = { "int", 4 },
+	[19] = { "else", 6 },
+	[20] = { "while", 5 },
+	[23] = { "static", 4 },
+	[28] = { "global", 4 },
+	[29] = { "for", 5 },
+	[30] = { "register", 4 },
+	[31] = { "default", 2 },
+	[33] = { "goto", 0 },
+	[37] = { "union", 3 },
+	[38] = { "sizeof", 7 },
+	[39] = { "short", 4 },
+	[44] = { "struct", 3 },
+	[45] = { "do", 6 },
+	[48] = { "switch", 1 },
+	[49] = { "float", 4 },
+	[55] = { "case", 2 },
+	[56] = { "char", 4 },
+	[57] = { "typedef", 4 },
+	[59] = { "enum", 3 },
+	[60] = { "void", 4 },
+	[63] = { "long", 4 },
 };
 
-struct templ *specials = specialsinit;
-int	nspecials = sizeof(specialsinit) / sizeof(specialsinit[0]);
-int	maxspecials;
 
 char        chartype[128] =
 {				/* this is used to facilitate the decision of
@@ -115,112 +131,86 @@ char        chartype[128] =
 
 
 int
-lexi(void)
+lexi(struct indent_ctx *ctx)
 {
     int         unary_delim;	/* this is set to 1 if the current token
 				 * forces a following operator to be unary */
-    static int  last_code;	/* the last token type returned */
-    static int  l_struct;	/* set to 1 if the last token was 'struct' */
     int         code;		/* internal code to be returned */
     char        qchar;		/* the delimiter character for a string */
     int		i;
+    long	t;		/* the token in the stream, if any */
+    char       *tp;		/* where the token starts */
+    size_t	n;
+    int		in_place = 0;	/* token is left in the input */
 
-    e_token = s_token;		/* point to start of place to save token */
+    ntokens++;
+    token = e_token = s_token;	/* point to start of place to save token */
     unary_delim = false;
     ps.col_1 = ps.last_nl;	/* tell world that this token started in
 				 * column 1 iff the last thing scanned was nl */
     ps.last_nl = false;
 
-    while (*buf_ptr == ' ' || *buf_ptr == '\t') {	/* get rid of blanks */
+    if (*buf_ptr == ' ' || *buf_ptr == '\t') {	/* get rid of blanks */
 	ps.col_1 = false;	/* leading blanks imply token is not in column
 				 * 1 */
-	if (++buf_ptr >= buf_end)
-	    fill_buffer();
+	skip_blanks(ctx);
     }
 
     /* Scan an alphanumeric token */
-    if (chartype[(int)*buf_ptr] == alphanum ||
+    if (ALNUM(*buf_ptr) ||
 	(buf_ptr[0] == '.' && isdigit((unsigned char)buf_ptr[1]))) {
 	/*
 	 * we have a character or number
 	 */
-	char *j;	/* used for searching thru list of
-			 * reserved words */
-	if (isdigit((unsigned char)*buf_ptr) ||
-	    (buf_ptr[0] == '.' && isdigit((unsigned char)buf_ptr[1]))) {
-	    int         seendot = 0,
-	                seenexp = 0,
-			seensfx = 0;
-	    if (*buf_ptr == '0' &&
-		    (buf_ptr[1] == 'x' || buf_ptr[1] == 'X')) {
-		*e_token++ = *buf_ptr++;
-		*e_token++ = *buf_ptr++;
-		while (isxdigit(*buf_ptr)) {
-		    CHECK_SIZE_TOKEN;
-		    *e_token++ = *buf_ptr++;
-		}
-	    }
-	    else
-		while (1) {
-		    if (*buf_ptr == '.') {
-			if (seendot)
-			    break;
-			else
-			    seendot++;
-		    }
-		    CHECK_SIZE_TOKEN;
-		    *e_token++ = *buf_ptr++;
-		    if (!isdigit((unsigned char)*buf_ptr) && *buf_ptr != '.') {
-			if ((*buf_ptr != 'E' && *buf_ptr != 'e') || seenexp)
-			    break;
-			else {
-			    seenexp++;
-			    seendot++;
-			    CHECK_SIZE_TOKEN;
-			    *e_token++ = *buf_ptr++;
-			    if (*buf_ptr == '+' || *buf_ptr == '-')
-				*e_token++ = *buf_ptr++;
-			}
-		    }
-		}
-	    while (1) {
-		if (!(seensfx & 1) &&
-			(*buf_ptr == 'U' || *buf_ptr == 'u')) {
-		    CHECK_SIZE_TOKEN;
-		    *e_token++ = *buf_ptr++;
-		    seensfx |= 1;
-		    continue;
-		}
-        	if (!(seensfx & 2) &&
-			(*buf_ptr == 'L' || *buf_ptr == 'l')) {
-		    CHECK_SIZE_TOKEN;
-		    if (buf_ptr[1] == buf_ptr[0])
-		        *e_token++ = *buf_ptr++;
-		    *e_token++ = *buf_ptr++;
-		    seensfx |= 2;
-		    continue;
+	n = 0;
+	t = ctx->toks != NULL ? tok_find(ctx, buf_ptr) : -1;
+	if (t != -1)
+	    n = ctx->toks->len[t];	/* scanned before formatting */
+	else if (isdigit((unsigned char)*buf_ptr) || *buf_ptr == '.')
+	    n = scan_name(buf_ptr);
+	else {
+	    char *p = buf_ptr + 1;
+
+	    while (p < buf_end && ALNUM(*p))
+		p++;
+	    if (p < buf_end)	/* else it goes on in the next buffer */
+		n = p - buf_ptr;
+	}
+	if (n > 0 && IN_PLACE) {
+	    token = buf_ptr;	/* no need to copy it */
+	    token_end = buf_ptr += n;
+	    in_place = 1;
+	} else {
+	    if (n > 0) {
+		if (l_token - e_token < n)
+		    grow_buf(&ctx->tok, n);
+		memcpy(e_token, buf_ptr, n);
+		e_token += n;
+		buf_ptr += n;
+	    } else
+		while (ALNUM(*buf_ptr)) {	/* copy it over */
+		    char *p = buf_ptr + 1;
+
+		    while (p < buf_end && ALNUM(*p))
+			p++;
+		    n = p - buf_ptr;
+		    if (l_token - e_token < n)
+			grow_buf(&ctx->tok, n);
+		    memcpy(e_token, buf_ptr, n);
+		    e_token += n;
+		    buf_ptr = p;
+		    if (buf_ptr >= buf_end)
+			fill_buffer(ctx);
 		}
-		break;
-	    }
-	    if (!(seensfx & 1) &&    
-	        (*buf_ptr == 'F' || *buf_ptr == 'f')) {
-		CHECK_SIZE_TOKEN;
-		*e_token++ = *buf_ptr++;
-		seensfx |= 1;
-	    }
+	    *e_token = '\0';
+	    token = s_token;
+	    token_end = e_token;
 	}
+	if (t != -1)
+	    i = ctx->toks->kind[t];
 	else
-	    while (chartype[(int)*buf_ptr] == alphanum) {	/* copy it over */
-		CHECK_SIZE_TOKEN;
-		*e_token++ = *buf_ptr++;
-		if (buf_ptr >= buf_end)
-		    fill_buffer();
-	    }
-	*e_token++ = '\0';
-	while (*buf_ptr == ' ' || *buf_ptr == '\t') {	/* get rid of blanks */
-	    if (++buf_ptr >= buf_end)
-		fill_buffer();
-	}
+	    i = keyword(ctx, token, token_end - token);
+	skip_blanks(ctx);	/* get rid of blanks */
 	ps.its_a_keyword = false;
 	ps.sizeof_keyword = false;
 	if (l_struct) {		/* if last token was 'struct', then this token
@@ -235,28 +225,12 @@ lexi(void)
 				 * return */
 
 	/*
-	 * This loop will check if the token is a keyword.
+	 * Check if the token is a keyword.
 	 */
-	for (i = 0; i < nspecials; i++) {
-	    char *p = s_token;	/* point at scanned token */
-	    j = specials[i].rwd;
-	    if (*j++ != *p++ || *j++ != *p++)
-		continue;	/* This test depends on the fact that
-				 * identifiers are always at least 1 character
-				 * long (ie. the first two bytes of the
-				 * identifier are always meaningful) */
-	    if (p[-1] == 0)
-		break;		/* If its a one-character identifier */
-	    while (*p++ == *j)
-		if (*j++ == 0)
-		    goto found_keyword;	/* I wish that C had a multi-level
-					 * break... */
-	}
-	if (i < nspecials) {		/* we have a keyword */
-    found_keyword:
+	if (i >= 0) {
 	    ps.its_a_keyword = true;
 	    ps.last_u_d = true;
-	    switch (specials[i].rwcode) {
+	    switch (i) {
 	    case 1:		/* it is a switch */
 		return (swstmt);
 	    case 2:		/* a case or default */
@@ -273,7 +247,7 @@ lexi(void)
 		 */
 	    case 4:		/* one of the declaration keywords */
 		if (ps.p_l_follow) {
-		    ps.cast_mask |= 1 << ps.p_l_follow;
+		    ps.cast_mask |= PAREN_BIT(ps.p_l_follow);
 		    break;	/* inside parens: cast */
 		}
 		last_code = decl;
@@ -297,7 +271,11 @@ lexi(void)
 	    while (tp < buf_end)
 		if (*tp++ == ')' && (*tp == ';' || *tp == ','))
 		    goto not_proc;
-	    strlcpy(ps.procname, token, sizeof ps.procname);
+	    n = token_end - token;
+	    if (n >= sizeof ps.procname)
+		n = sizeof ps.procname - 1;
+	    memcpy(ps.procname, token, n);
+	    ps.procname[n] = '\0';
 	    ps.in_parameter_declaration = 1;
 	    rparen_count = 1;
     not_proc:;
@@ -328,11 +306,12 @@ lexi(void)
 
     /* Scan a non-alphanumeric token */
 
+    tp = buf_ptr;
     *e_token++ = *buf_ptr;		/* if it is only a one-character token, it is
 				 * moved here */
     *e_token = '\0';
     if (++buf_ptr >= buf_end)
-	fill_buffer();
+	fill_buffer(ctx);
 
     switch (*token) {
     case '\n':
@@ -348,11 +327,35 @@ lexi(void)
 
     case '\'':			/* start of quoted character */
     case '"':			/* start of string */
+	n = 0;
+	if (buf_ptr == tp + 1) {	/* else it goes on in the next buffer */
+	    if (ctx->toks != NULL && (t = tok_find(ctx, tp)) != -1)
+		n = ctx->toks->len[t];	/* scanned before formatting */
+	    else
+		n = scan_literal(tp, buf_end);
+	}
+	if (n > 0) {
+	    if (IN_PLACE) {
+		token = tp;	/* no need to copy it */
+		token_end = tp + n;
+		in_place = 1;
+	    } else {
+		if (l_token - e_token < n)
+		    grow_buf(&ctx->tok, n);
+		memcpy(e_token, buf_ptr, n - 1);
+		e_token += n - 1;
+	    }
+	    buf_ptr = tp + n;
+	    code = ident;
+	    break;
+	}
 	qchar = *token;
 	do {			/* copy the string */
 	    while (1) {		/* move one character or [/<char>]<char> */
 		if (*buf_ptr == '\n') {
-		    printf("%d: Unterminated literal\n", line_no);
+		    line_refs++;
+		    if (!range_off)
+			out_printf(ctx, "%d: Unterminated literal\n", line_no);
 		    goto stop_lit;
 		}
 		CHECK_SIZE_TOKEN;	/* Only have to do this once in this loop,
@@ -360,7 +363,7 @@ lexi(void)
 					 * are at least 5 entries left */
 		*e_token = *buf_ptr++;
 		if (buf_ptr >= buf_end)
-		    fill_buffer();
+		    fill_buffer(ctx);
 		if (*e_token == BACKSLASH) {	/* if escape, copy extra char */
 		    if (*buf_ptr == '\n')	/* check for escaped newline */
 			++line_no;
@@ -368,7 +371,7 @@ lexi(void)
 		    ++e_token;	/* we must increment this again because we
 				 * copied two chars */
 		    if (buf_ptr >= buf_end)
-			fill_buffer();
+			fill_buffer(ctx);
 		}
 		else
 		    break;	/* we copied one character */
@@ -486,7 +489,7 @@ stop_lit:
 	if (*buf_ptr == '>' || *buf_ptr == '<' || *buf_ptr == '=') {
 	    *e_token++ = *buf_ptr;
 	    if (++buf_ptr >= buf_end)
-		fill_buffer();
+		fill_buffer(ctx);
 	}
 	if (*buf_ptr == '=')
 	    *e_token++ = *buf_ptr++;
@@ -500,7 +503,7 @@ stop_lit:
 	    *e_token++ = '*';
 
 	    if (++buf_ptr >= buf_end)
-		fill_buffer();
+		fill_buffer(ctx);
 
 	    code = comment;
 	    unary_delim = ps.last_u_d;
@@ -512,7 +515,7 @@ stop_lit:
 	     */
 	    *e_token++ = *buf_ptr;
 	    if (++buf_ptr >= buf_end)
-		fill_buffer();
+		fill_buffer(ctx);
 	}
 	code = (ps.last_u_d ? unary_op : binary_op);
 	unary_delim = true;
@@ -524,51 +527,212 @@ stop_lit:
 	last_code = code;
     }
     if (buf_ptr >= buf_end)	/* check for input buffer empty */
-	fill_buffer();
+	fill_buffer(ctx);
     ps.last_u_d = unary_delim;
     *e_token = '\0';		/* null terminate the token */
+    if (!in_place) {		/* tokenbuf may have moved as it grew */
+	token = s_token;
+	token_end = e_token;
+    }
     return (code);
 }
 
+/*
+ * The length of the name or number at p, which is followed by a newline at
+ * the latest.  A name ends at a byte outside ASCII.
+ */
+size_t
+scan_name(const char *p)
+{
+    const char *s = p;
+    int         seendot = 0,
+                seenexp = 0,
+		seensfx = 0;
+
+    if (!isdigit((unsigned char)*p) && *p != '.') {
+	while (ALNUM(*p))
+	    p++;
+	return (p - s);
+    }
+    if (*p == '0' && (p[1] == 'x' || p[1] == 'X')) {
+	p += 2;
+	while (isxdigit((unsigned char)*p))
+	    p++;
+    }
+    else
+	while (1) {
+	    if (*p == '.') {
+		if (seendot)
+		    break;
+		else
+		    seendot++;
+	    }
+	    p++;
+	    if (!isdigit((unsigned char)*p) && *p != '.') {
+		if ((*p != 'E' && *p != 'e') || seenexp)
+		    break;
+		else {
+		    seenexp++;
+		    seendot++;
+		    p++;
+		    if (*p == '+' || *p == '-')
+			p++;
+		}
+	    }
+	}
+    while (1) {
+	if (!(seensfx & 1) && (*p == 'U' || *p == 'u')) {
+	    p++;
+	    seensfx |= 1;
+	    continue;
+	}
+	if (!(seensfx & 2) && (*p == 'L' || *p == 'l')) {
+	    if (p[1] == p[0])
+		p++;
+	    p++;
+	    seensfx |= 2;
+	    continue;
+	}
+	break;
+    }
+    if (!(seensfx & 1) && (*p == 'F' || *p == 'f'))
+	p++;
+    return (p - s);
+}
+
+/*
+ * The length of the literal at p, up to its closing quote, if that is on
+ * the same line and before end; else 0.
+ */
+size_t
+scan_literal(const char *p, const char *end)
+{
+    const char *q;
+
+    for (q = p + 1; q < end && *q != *p && *q != '\n'; q++)
+	if (*q == BACKSLASH && (++q == end || *q == '\n'))
+	    return (0);
+    return (q < end && *q == *p ? q + 1 - p : 0);
+}
+
+/*
+ * Skip the blanks and tabs at buf_ptr, a run at a time rather than checking
+ * for the end of the buffer after every one.
+ */
+static void
+skip_blanks(struct indent_ctx *ctx)
+{
+    char *p;
+
+    while (*buf_ptr == ' ' || *buf_ptr == '\t') {
+	for (p = buf_ptr + 1; p < buf_end && (*p == ' ' || *p == '\t'); p++)
+	    ;
+	buf_ptr = p;
+	if (buf_ptr >= buf_end)
+	    fill_buffer(ctx);
+    }
+}
+
+/*
+ * Hash for the table of keywords added by addkey.
+ */
+static unsigned int
+usrkw_hash(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*s++) * 16777619u;
+    return (h);
+}
+
+/*
+ * Look up the len bytes at s.  Returns the keyword type, or -1 if it is not
+ * a keyword.
+ */
+int
+keyword(struct indent_ctx *ctx, const char *s, size_t len)
+{
+    const struct templ *p;
+    unsigned int h;
+
+    if (len == 0)
+	return (-1);
+    p = &kwtab[KW_HASH(s, len)];
+    if (p->rwd != NULL && p->rwd[0] == s[0] &&
+	strncmp(p->rwd, s, len) == 0 && p->rwd[len] == '\0')
+	return (p->rwcode);
+    if (usrkw_n == 0)
+	return (-1);
+    for (h = usrkw_hash(s, len);; h++) {
+	p = &usrkw[h & (usrkw_size - 1)];
+	if (p->rwd == NULL)
+	    return (-1);
+	if (p->rwd[0] == s[0] && strncmp(p->rwd, s, len) == 0 &&
+	    p->rwd[len] == '\0')
+	    return (p->rwcode);
+    }
+}
+
 /*
  * Add the given keyword to the keyword table, using val as the keyword type
  */
 void
-addkey(char *key, int val)
+addkey(struct indent_ctx *ctx, char *key, int val)
 {
-    struct templ *p;
-    int i;
+    struct templ *p, *old;
+    unsigned int i, h, oldsize;
+    size_t len = strlen(key);
 
-    for (i = 0; i < nspecials; i++) {
-	p = &specials[i];
-	if (p->rwd[0] == key[0] && strcmp(p->rwd, key) == 0)
-	    return;
-    }
+    if (keyword(ctx, key, len) >= 0)
+	return;
 
-    if (specials == specialsinit) {
+    if ((usrkw_n + 1) * 2 > usrkw_size) {
 	/*
-	 * Whoa. Must reallocate special table.
+	 * Keep the table at most half full, so probes stay short.
 	 */
-	nspecials = sizeof (specialsinit) / sizeof (specialsinit[0]);
-	maxspecials = nspecials + (nspecials >> 2);
-	specials = calloc(maxspecials, sizeof specials[0]);
-	if (specials == NULL)
+	old = usrkw;
+	oldsize = usrkw_size;
+	usrkw_size = oldsize ? oldsize * 2 : 64;
+	usrkw = calloc(usrkw_size, sizeof usrkw[0]);
+	if (usrkw == NULL)
 	    err(1, NULL);
-	memcpy(specials, specialsinit, sizeof specialsinit);
-    } else if (nspecials >= maxspecials) {
-	int newspecials = maxspecials + (maxspecials >> 2);
-	struct templ *specials2;
-
-	specials2 = reallocarray(specials, newspecials, sizeof(specials[0]));
-	if (specials2 == NULL)
-	    err(1, NULL);
-	specials = specials2;
-	maxspecials = newspecials;
+	for (i = 0; i < oldsize; i++) {
+	    if (old[i].rwd == NULL)
+		continue;
+	    h = usrkw_hash(old[i].rwd, strlen(old[i].rwd));
+	    while (usrkw[h & (usrkw_size - 1)].rwd != NULL)
+		h++;
+	    usrkw[h & (usrkw_size - 1)] = old[i];
+	}
+	free(old);
     }
 
-    p = &specials[nspecials];
+    h = usrkw_hash(key, len);
+    while (usrkw[h & (usrkw_size - 1)].rwd != NULL)
+	h++;
+    p = &usrkw[h & (usrkw_size - 1)];
     p->rwd = key;
     p->rwcode = val;
-    nspecials++;
-    return;
+    usrkw_n++;
+}
+
+/*
+ * Set up the keyword table of a new context.
+ */
+void
+keywords_init(struct indent_ctx *ctx)
+{
+    usrkw = NULL;
+    usrkw_n = usrkw_size = 0;
+}
+
+/*
+ * Free the keywords added by addkey.
+ */
+void
+keywords_free(struct indent_ctx *ctx)
+{
+    free(usrkw);
+    keywords_init(ctx);
 }
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 1980, 1993
+ *	The Regents of the University of California.
+ * Copyright (c) 1976 Board of Trustees of the University of Illinois.
+ * Copyright (c) 1985 Sun Microsystems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "indent.h"
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+	"usage: indent [-0cd] [-C dir] [-j jobs] [-o dir] [file ...]\n"
+	"       indent [-c | -d | -e | -j jobs | -p] [-r first[:last] ...]\n"
+	"       indent [-e] -s | -S socket\n");
+    exit(1);
+}
+
+/*
+ * Parse a line range, "first:last" or a single line "first".
+ */
+static void
+parse_range(const char *arg, struct indent_range *r)
+{
+    char buf[32], *colon;
+    const char *errstr;
+
+    if (strlcpy(buf, arg, sizeof buf) >= sizeof buf)
+	errx(1, "range is too long: %s", arg);
+    if ((colon = strchr(buf, ':')) != NULL)
+	*colon++ = '\0';
+    r->first = strtonum(buf, 1, INT_MAX, &errstr);
+    if (errstr != NULL)
+	errx(1, "range start is %s: %s", errstr, arg);
+    r->last = r->first;
+    if (colon != NULL) {
+	r->last = strtonum(colon, r->first, INT_MAX, &errstr);
+	if (errstr != NULL)
+	    errx(1, "range end is %s: %s", errstr, arg);
+    }
+}
+
+/*
+ * Read all of stdin.  There is room for one more byte after it.
+ */
+static char *
+read_stdin(size_t *lenp)
+{
+    char *buf = NULL;
+    size_t len = 0, size = 0;
+    ssize_t r;
+
+    for (;;) {
+	if (size - len < 4096) {
+	    size = size ? size * 2 : 65536;
+	    if ((buf = realloc(buf, size + 1)) == NULL)
+		err(1, NULL);
+	}
+	if ((r = read(STDIN_FILENO, buf + len, size - len)) == -1)
+	    err(1, "stdin");
+	if (r == 0)
+	    break;
+	len += r;
+    }
+    *lenp = len;
+    return (buf);
+}
+
+/*
+ * Read a list of NUL separated paths from stdin.
+ */
+static char **
+read_paths(size_t *np)
+{
+    char *buf, *p, *end, **paths;
+    size_t len, n;
+
+    buf = read_stdin(&len);
+    if (len > 0 && buf[len - 1] != '\0')
+	buf[len++] = '\0';
+    end = buf + len;
+    for (n = 0, p = buf; p < end; p += strlen(p) + 1)
+	n++;
+    if ((paths = calloc(n + 1, sizeof paths[0])) == NULL)
+	err(1, NULL);
+    for (n = 0, p = buf; p < end; p += strlen(p) + 1)
+	if (*p != '\0')
+	    paths[n++] = p;
+    *np = n;
+    return (paths);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct indent_ctx *ctx;
+    struct indent_range *ranges = NULL;
+    const char *outdir = NULL, *cachedir = NULL, *sockpath = NULL, *errstr;
+    char **paths;
+    size_t npaths, nranges = 0;
+    long ncpu;
+    int ch, nul = 0, jobs = 0, serve = 0, check = 0, diff = 0, edits = 0;
+    int pipeline = 0, line, status;
+
+    while ((ch = getopt(argc, argv, "0cC:dej:o:pr:sS:")) != -1)
+	switch (ch) {
+	case '0':
+	    nul = 1;
+	    break;
+	case 'c':
+	    check = 1;
+	    break;
+	case 'C':
+	    cachedir = optarg;
+	    break;
+	case 'd':
+	    diff = 1;
+	    break;
+	case 'e':
+	    edits = 1;
+	    break;
+	case 'j':
+	    jobs = strtonum(optarg, 1, 1024, &errstr);
+	    if (errstr != NULL)
+		errx(1, "jobs is %s: %s", errstr, optarg);
+	    break;
+	case 'o':
+	    outdir = optarg;
+	    break;
+	case 'p':
+	    pipeline = 1;
+	    break;
+	case 'r':
+	    ranges = reallocarray(ranges, nranges + 1, sizeof ranges[0]);
+	    if (ranges == NULL)
+		err(1, NULL);
+	    parse_range(optarg, &ranges[nranges++]);
+	    break;
+	case 's':
+	    serve = 1;
+	    break;
+	case 'S':
+	    sockpath = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    argc -= optind;
+    argv += optind;
+    if ((nul && argc > 0) || check + diff + edits > 1 ||
+	((check || diff) && outdir != NULL))
+	usage();
+    if (nranges > 0 && (nul || argc > 0 || serve || sockpath != NULL))
+	usage();		/* ranges are only for one input */
+    if (pipeline && (nul || argc > 0 || serve || sockpath != NULL || check ||
+	diff || edits || jobs != 0))
+	usage();		/* as is the pipeline */
+
+    if (serve || sockpath != NULL) {
+	if (nul || argc > 0 || outdir != NULL || cachedir != NULL || check ||
+	    diff || jobs != 0 || (serve && sockpath != NULL))
+	    usage();
+	if (pledge(serve ? "stdio" : "stdio rpath cpath unix", NULL) == -1)
+	    err(1, "pledge");
+	ctx = indent_alloc();
+	if (serve)
+	    status = indent_serve(ctx, STDIN_FILENO, STDOUT_FILENO,
+		edits ? INDENT_EDITS : 0) ? 1 : 0;
+	else if ((status = indent_serve_socket(ctx, sockpath,
+	    edits ? INDENT_EDITS : 0)) == -1)
+	    err(1, "%s", sockpath);
+	indent_release(ctx);
+	return (status);
+    }
+
+    if (edits && (nul || argc > 0))
+	usage();		/* edits are for an editor, one input */
+
+    if (!nul && argc == 0) {
+	if (outdir != NULL || cachedir != NULL ||
+	    (jobs != 0 && (check || diff || edits)))
+	    usage();
+	if (pledge("stdio", NULL) == -1)
+	    err(1, "pledge");
+	ctx = indent_alloc();
+	indent_set_ranges(ctx, ranges, nranges);
+	free(ranges);
+	if (check) {
+	    if ((line = indent_check(ctx, STDIN_FILENO)) == -1)
+		err(1, "read");
+	    if (line != 0)
+		warnx("stdin: differs at line %d", line);
+	    status = line != 0 ? 2 : 0;
+	} else if (diff || edits || jobs > 1) {
+	    struct indent_result res;
+	    char *in;
+	    size_t len;
+
+	    in = read_stdin(&len);
+	    if (diff)
+		indent_diff(ctx, "stdin", in, len, &res);
+	    else if (edits)
+		indent_edits(ctx, in, len, &res);
+	    else
+		indent_parallel(ctx, in, len, jobs, &res);
+	    if (fwrite(res.out, 1, res.outlen, stdout) != res.outlen ||
+		fflush(stdout) == EOF)
+		err(1, "stdout");
+	    status = diff ? (res.outlen > 0 ? 2 : 0) : res.status;
+	    indent_result_free(&res);
+	    free(in);
+	} else if (pipeline)
+	    status = indent_pipe(ctx, STDIN_FILENO, STDOUT_FILENO);
+	else if ((status = indent_file(ctx, STDIN_FILENO,
+	    STDOUT_FILENO)) == -1)
+	    err(1, NULL);
+	indent_release(ctx);
+	return (status);
+    }
+
+    if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+	err(1, "pledge");
+    if (nul)
+	paths = read_paths(&npaths);
+    else {
+	paths = argv;
+	npaths = argc;
+    }
+    if (jobs == 0) {
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	jobs = ncpu > 0 ? (ncpu < 1024 ? ncpu : 1024) : 1;
+    }
+    if ((status = indent_batch(paths, npaths, jobs, outdir, cachedir,
+	check ? INDENT_CHECK : diff ? INDENT_DIFF : 0)) == -1)
+	err(1, NULL);
+    return (status);
+}
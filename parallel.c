@@ -0,0 +1,222 @@
+/*
+ * Format one large input on several threads.
+ *
+ * The input is cut into chunks at lines that a quick scan takes for the top
+ * level: no braces, parens or #if open, not inside a comment, a string or a
+ * preprocessor line, and after a ';' or a '}'.  Each chunk is formatted on
+ * a thread of its own as if it were a whole input, by indent_reformat, so
+ * that it leaves its checkpoints behind (see reformat.c).
+ *
+ * The scan can be wrong, and a chunk is formatted starting from the state
+ * of a fresh input and not from the state the input before it leaves, so
+ * a chunk's output is only used where it is known to be right.  The calling
+ * thread formats the input in order and, at each top level line inside a
+ * chunk, compares its state with the chunk's checkpoint there.  Once they
+ * are the same, formatting the rest of the chunk in order must give what
+ * the chunk's own run gave, so its output up to its last checkpoint is
+ * taken over and formatting goes on from that checkpoint into the next
+ * chunk.  A chunk whose state never comes right is formatted again in
+ * order, so the output is always the same as from indent_buffer, and at
+ * worst it takes as long.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "indent_globs.h"
+
+#define CHUNK_MIN	(64 * 1024)	/* smaller chunks are not worth it */
+
+struct chunk {
+    const char *in;		/* where the chunk starts in the input */
+    size_t      len;
+    struct indent_ctx *ctx;	/* formatted it, and has its checkpoints */
+    struct tokens *toks;	/* of the whole input, shared */
+    pthread_t   tid;
+    int         running;	/* tid is to be joined */
+};
+
+struct par {
+    struct chunk *c;
+    size_t      n;
+    size_t      next;		/* the first chunk not joined or passed */
+};
+
+/*
+ * Look for up to n - 1 places to cut the input at, about evenly spaced,
+ * and put them in offs after offset 0.  Returns the number of chunks.
+ */
+static size_t
+cut(const char *in, size_t len, size_t n, size_t *offs)
+{
+    const char *p = in, *end = in + len, *q;
+    size_t k = 1;
+    int depth = 0, ifs = 0, last = ';', c;
+
+    offs[0] = 0;
+    while (p < end && k < n) {
+	/* at the start of a line */
+	if (depth == 0 && ifs == 0 && (last == ';' || last == '}') &&
+	    (size_t)(p - in) >= len / n * k)
+	    offs[k++] = p - in;
+	for (q = p; q < end && (*q == ' ' || *q == '\t'); q++)
+	    ;
+	if (q < end && *q == '#') {
+	    for (q++; q < end && (*q == ' ' || *q == '\t'); q++)
+		;
+	    if (end - q >= 2 && strncmp(q, "if", 2) == 0)
+		ifs++;
+	    else if (end - q >= 5 && strncmp(q, "endif", 5) == 0)
+		ifs--;
+	    for (; q < end && *q != '\n'; q++)	/* with its continuations */
+		if (*q == '\\' && q + 1 < end && q[1] == '\n')
+		    q++;
+	    p = q + 1;
+	    continue;
+	}
+	for (; p < end && *p != '\n'; p++) {
+	    switch (c = *p) {
+	    case '/':
+		if (p + 1 < end && p[1] == '/') {
+		    while (p + 1 < end && p[1] != '\n')
+			p++;
+		} else if (p + 1 < end && p[1] == '*') {
+		    for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/');
+			p++)
+			;
+		    p++;	/* no cut in the lines it runs over */
+		} else
+		    last = c;
+		break;
+	    case '"':
+	    case '\'':
+		for (p++; p < end && *p != c && *p != '\n'; p++)
+		    if (*p == '\\' && p + 1 < end)
+			p++;	/* even a newline */
+		if (p < end && *p == '\n')
+		    p--;
+		last = c;
+		break;
+	    case '{':
+	    case '(':
+	    case '[':
+		depth++;
+		last = c;
+		break;
+	    case '}':
+	    case ')':
+	    case ']':
+		depth--;
+		last = c;
+		break;
+	    case ' ':
+	    case '\t':
+	    case '\r':
+	    case '\f':
+		break;
+	    default:
+		last = c;
+	    }
+	}
+	p++;
+    }
+    return (k);
+}
+
+static void *
+run_chunk(void *arg)
+{
+    struct chunk *c = arg;
+    struct indent_result res;
+
+    c->ctx = indent_alloc();
+    c->ctx->toks = c->toks;
+    indent_reformat(c->ctx, c->in, c->len, &res);
+    c->ctx->toks = NULL;
+    indent_result_free(&res);
+    return (NULL);
+}
+
+/*
+ * Called at the start of each line.  Join the chunk this line is in, if the
+ * state has come right for it.  Returns 1 if the last chunk was joined,
+ * which gives all the rest of the output.
+ */
+int
+par_take(struct indent_ctx *ctx)
+{
+    struct par *p = ctx->par;
+    struct chunk *c;
+
+    if (p->next >= p->n || !ckpt_top(ctx))
+	return (0);
+    while (p->next + 1 < p->n && p->c[p->next + 1].in <= buf_ptr)
+	p->next++;		/* passed without joining */
+    c = &p->c[p->next];
+    if (buf_ptr < c->in)
+	return (0);
+    if (c->running) {
+	pthread_join(c->tid, NULL);
+	c->running = 0;
+    }
+    if (!ckpt_join(ctx, c->ctx->rf, c->in, buf_ptr - c->in,
+	p->next == p->n - 1))
+	return (0);
+    return (++p->next == p->n);
+}
+
+int
+indent_parallel(struct indent_ctx *ctx, const char *in, size_t len,
+    int nthreads, struct indent_result *res)
+{
+    struct par p;
+    struct arena a;
+    struct tokens *toks;
+    size_t offs[64], i;
+    int status;
+
+    if (in == NULL)
+	in = "";
+    p.n = len / CHUNK_MIN;
+    if (p.n > (size_t)nthreads)
+	p.n = nthreads;
+    if (p.n > sizeof offs / sizeof offs[0])
+	p.n = sizeof offs / sizeof offs[0];
+    if (nranges > 0 || p.n < 2 || (p.n = cut(in, len, p.n, offs)) < 2)
+	return (indent_buffer(ctx, in, len, res));
+
+    if ((p.c = calloc(p.n, sizeof p.c[0])) == NULL)
+	err(1, NULL);
+    /* for all chunks, so not in ctx's arena, which each input resets */
+    memset(&a, 0, sizeof a);
+    toks = ctx->tok_on ? tok_scan(ctx, &a, in, len) : NULL;
+    for (i = 0; i < p.n; i++) {
+	p.c[i].toks = toks;
+	p.c[i].in = in + offs[i];
+	p.c[i].len = (i + 1 < p.n ? offs[i + 1] : len) - offs[i];
+    }
+    /* the calling thread takes the first chunk */
+    for (i = 1; i < p.n; i++)
+	if (pthread_create(&p.c[i].tid, NULL, run_chunk, &p.c[i]) == 0)
+	    p.c[i].running = 1;
+	else
+	    run_chunk(&p.c[i]);
+    run_chunk(&p.c[0]);
+
+    p.next = 0;
+    ctx->par = &p;
+    ctx->toks = toks;
+    status = indent_buffer(ctx, in, len, res);
+    ctx->toks = NULL;
+    ctx->par = NULL;
+
+    for (i = 0; i < p.n; i++) {
+	if (p.c[i].running)
+	    pthread_join(p.c[i].tid, NULL);
+	indent_release(p.c[i].ctx);
+    }
+    free(p.c);
+    arena_free(&a);
+    return (status);
+}
@@ -33,19 +33,24 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
 #include "indent_globs.h"
 #include "indent_codes.h"
 
-void reduce(void);
+static void reduce(struct indent_ctx *);
 
 void
-parse(int tk)			/* the code for the construct scanned */
+parse(struct indent_ctx *ctx, int tk)			/* the code for the construct scanned */
 {
+    ps_grow(&ps, ps.tos + 2);	/* room for the most this can push */
+
     while (ps.p_stack[ps.tos] == ifhead && tk != elselit) {
 	/* true if we have an if without an else */
 	ps.p_stack[ps.tos] = stmt;	/* apply the if(..) stmt ::= stmt
 					 * reduction */
-	reduce();		/* see if this allows any reduction */
+	reduce(ctx);		/* see if this allows any reduction */
     }
 
 
@@ -124,7 +129,7 @@ parse(int tk)			/* the code for the construct scanned */
     case elselit:		/* scanned an else */
 
 	if (ps.p_stack[ps.tos] != ifhead)
-	    diag(1, "Unmatched 'else'");
+	    diag(ctx, 1, "Unmatched 'else'");
 	else {
 	    ps.ind_level = ps.il[ps.tos];	/* indentation for else should
 						 * be same as for if */
@@ -143,7 +148,7 @@ parse(int tk)			/* the code for the construct scanned */
 	    ps.p_stack[ps.tos] = stmt;
 	}
 	else
-	    diag(1, "Stmt nesting error.");
+	    diag(ctx, 1, "Stmt nesting error.");
 	break;
 
     case swstmt:		/* had switch (...) */
@@ -167,13 +172,13 @@ parse(int tk)			/* the code for the construct scanned */
 	break;
 
     default:			/* this is an error */
-	diag(1, "Unknown code to parser");
+	diag(ctx, 1, "Unknown code to parser");
 	return;
 
 
     }				/* end of switch */
 
-    reduce();			/* see if any reduction can be done */
+    reduce(ctx);			/* see if any reduction can be done */
 
     return;
 }
@@ -217,8 +222,8 @@ parse(int tk)			/* the code for the construct scanned */
 /*----------------------------------------------*\
 |   REDUCTION PHASE				    |
 \*----------------------------------------------*/
-void
-reduce(void)
+static void
+reduce(struct indent_ctx *ctx)
 {
 
     int i;
@@ -298,3 +303,160 @@ reduce(void)
 	}
     }
 }
+
+/*
+ * Make the parser stacks deep enough that depth is a valid index.  The
+ * three stacks share one allocation, so that the usual shallow stack is a
+ * few cache lines.  p_stack[-1] is there too, always 0, as a stray '}'
+ * looks below the bottom of the stack.
+ */
+void
+ps_grow(struct parser_state *p, int depth)
+{
+    int size = p->stacksize > 0 ? p->stacksize : STACKSIZE;
+    char *mem;
+
+    if (depth < p->stacksize)
+	return;
+    while (depth >= size)
+	size *= 2;
+    mem = calloc(1, sizeof(int) + size * (2 * sizeof(int) + sizeof(float)));
+    if (mem == NULL)
+	err(1, NULL);
+    mem += sizeof(int);		/* for p_stack[-1] */
+    if (p->stacksize > 0) {
+	memcpy(mem, p->p_stack, p->stacksize * sizeof(int));
+	memcpy(mem + size * sizeof(int), p->il, p->stacksize * sizeof(int));
+	memcpy(mem + size * 2 * sizeof(int), p->cstk,
+	    p->stacksize * sizeof(float));
+	free(p->p_stack - 1);
+    }
+    p->p_stack = (int *)mem;
+    p->il = p->p_stack + size;
+    p->cstk = (float *)(p->il + size);
+    p->stacksize = size;
+}
+
+/*
+ * Make paren_indents hold at least n entries.
+ */
+void
+ps_grow_parens(struct parser_state *p, int n)
+{
+    int size = p->paren_size > 0 ? p->paren_size : PARENSIZE;
+    short *np;
+
+    if (n <= p->paren_size)
+	return;
+    while (n > size)
+	size *= 2;
+    if ((np = reallocarray(p->paren_indents, size, sizeof *np)) == NULL)
+	err(1, NULL);
+    memset(np + p->paren_size, 0, (size - p->paren_size) * sizeof *np);
+    p->paren_indents = np;
+    p->paren_size = size;
+}
+
+/*
+ * Reset the state for a new input, keeping the stacks.  The bottom entries
+ * are read before they are ever pushed, so the stacks are cleared too.
+ */
+void
+ps_clear(struct parser_state *p)
+{
+    struct parser_state keep = *p;
+
+    if (p->stacksize > 0)
+	memset(p->p_stack, 0,
+	    p->stacksize * (2 * sizeof(int) + sizeof(float)));
+    if (p->paren_size > 0)
+	memset(p->paren_indents, 0, p->paren_size * sizeof(short));
+    memset(p, 0, sizeof *p);
+    p->p_stack = keep.p_stack;
+    p->il = keep.il;
+    p->cstk = keep.cstk;
+    p->stacksize = keep.stacksize;
+    p->paren_indents = keep.paren_indents;
+    p->paren_size = keep.paren_size;
+}
+
+/*
+ * Copy the state in src to dst.  dst keeps stacks of its own, and only the
+ * live part of the stacks is copied.
+ */
+void
+ps_copy(struct parser_state *dst, const struct parser_state *src)
+{
+    struct parser_state keep = *dst;
+    int n;
+
+    *dst = *src;
+    dst->p_stack = keep.p_stack;
+    dst->il = keep.il;
+    dst->cstk = keep.cstk;
+    dst->stacksize = keep.stacksize;
+    dst->paren_indents = keep.paren_indents;
+    dst->paren_size = keep.paren_size;
+
+    n = src->tos + 1;
+    ps_grow(dst, n);
+    if (n > 0) {
+	memcpy(dst->p_stack, src->p_stack, n * sizeof(int));
+	memcpy(dst->il, src->il, n * sizeof(int));
+	memcpy(dst->cstk, src->cstk, n * sizeof(float));
+    }
+    n = src->p_l_follow > src->paren_level ? src->p_l_follow :
+	src->paren_level;
+    if (n > 0) {
+	ps_grow_parens(dst, n);
+	memcpy(dst->paren_indents, src->paren_indents, n * sizeof(short));
+    }
+}
+
+/*
+ * Return true if a and b would format the rest of an input the same way.
+ * The counters kept for statistics are not compared, and neither is
+ * anything past the live part of the stacks.
+ */
+int
+ps_same(const struct parser_state *a, const struct parser_state *b)
+{
+#define SAME(f) (a->f == b->f)
+    int n;
+
+    if (!(SAME(last_token) && SAME(box_com) && SAME(comment_delta) &&
+	SAME(n_comment_delta) && SAME(cast_mask) && SAME(sizeof_mask) &&
+	SAME(block_init) && SAME(block_init_level) && SAME(last_nl) &&
+	SAME(in_or_st) && SAME(bl_line) && SAME(col_1) && SAME(com_col) &&
+	SAME(com_ind) && SAME(dec_nest) && SAME(decl_com_ind) &&
+	SAME(decl_on_line) && SAME(i_l_follow) && SAME(in_decl) &&
+	SAME(in_stmt) && SAME(ind_level) && SAME(ind_size) &&
+	SAME(ind_stmt) && SAME(last_u_d) && SAME(p_l_follow) &&
+	SAME(paren_level) && SAME(pcase) && SAME(search_brace) &&
+	SAME(unindent_displace) && SAME(use_ff) && SAME(want_blank) &&
+	SAME(decl_indent) && SAME(its_a_keyword) && SAME(sizeof_keyword) &&
+	SAME(dumped_decl_indent) && SAME(case_indent) &&
+	SAME(in_parameter_declaration) && SAME(tos) &&
+	SAME(just_saw_decl)))
+	return (0);
+#undef SAME
+    if (strcmp(a->procname, b->procname) != 0)
+	return (0);
+    n = a->tos + 1;
+    if (n > 0 && (memcmp(a->p_stack, b->p_stack, n * sizeof(int)) != 0 ||
+	memcmp(a->il, b->il, n * sizeof(int)) != 0 ||
+	memcmp(a->cstk, b->cstk, n * sizeof(float)) != 0))
+	return (0);
+    n = a->p_l_follow > a->paren_level ? a->p_l_follow : a->paren_level;
+    return (n <= 0 || memcmp(a->paren_indents, b->paren_indents,
+	n * sizeof(short)) == 0);
+}
+
+void
+ps_free(struct parser_state *p)
+{
+    if (p->p_stack != NULL)
+	free(p->p_stack - 1);
+    free(p->paren_indents);
+    memset(p, 0, sizeof *p);
+}
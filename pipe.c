@@ -0,0 +1,279 @@
+/*
+ * Format a stream with reading, formatting and writing each on a thread of
+ * its own, so that a long input from a pipe takes about as long as the
+ * slowest of the three instead of all three one after another.
+ *
+ * The reader fills blocks from the input and the writer empties blocks of
+ * output, and each hands its blocks to or from the formatting thread
+ * through a ring of RING_SIZE of them.  A ring has one thread putting
+ * blocks in and one taking them out, in the same order, so a block needs
+ * no other bookkeeping: the one at head is being filled, the ones from
+ * tail up to head are full, and the one at tail is being emptied.  The
+ * lock only guards the two counts, and a thread waits on it only when the
+ * ring is full or empty; a block is 64k, so that is rare.
+ *
+ * The reader is only started if the input cannot be mapped (see
+ * open_input).  If a thread cannot be started, its work is done by the
+ * formatting thread as it is without a pipeline.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include "indent_globs.h"
+
+#define RING_SIZE	4		/* blocks in each ring */
+#define BLOCK_SIZE	65536		/* as rd_size in io.c */
+
+struct block {
+    char       *buf;
+    size_t      len;		/* bytes in use; 0 ends the stream */
+    size_t      size;		/* size of buf */
+};
+
+struct ring {
+    struct block b[RING_SIZE];
+    size_t      head;		/* blocks put in */
+    size_t      tail;		/* blocks taken out */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;	/* head or tail moved */
+};
+
+struct pipeline {
+    struct ring in;		/* from the reader */
+    struct ring out;		/* to the writer */
+    int         fd_in;
+    int         fd_out;
+    pthread_t   rtid;
+    pthread_t   wtid;
+    int         reading;	/* the reader is running */
+    int         writing;	/* the writer is running */
+    int         held;		/* a block from the reader is in use */
+    int         eof;		/* the reader is done */
+    int         rerr;		/* errno of a failed read */
+    int         werr;		/* errno of a failed write */
+};
+
+static void
+ring_init(struct ring *r)
+{
+    memset(r->b, 0, sizeof r->b);
+    r->head = r->tail = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+}
+
+static void
+ring_free(struct ring *r)
+{
+    int i;
+
+    for (i = 0; i < RING_SIZE; i++)
+	free(r->b[i].buf);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+}
+
+/*
+ * Wait for a block to fill, and return it.
+ */
+static struct block *
+ring_space(struct ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->head - r->tail == RING_SIZE)
+	pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    return (&r->b[r->head % RING_SIZE]);
+}
+
+/*
+ * Hand over the block that was filled.
+ */
+static void
+ring_put(struct ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->head++;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Wait for a full block, and return it.
+ */
+static struct block *
+ring_next(struct ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->head == r->tail)
+	pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    return (&r->b[r->tail % RING_SIZE]);
+}
+
+/*
+ * Give back the block that was emptied.
+ */
+static void
+ring_done(struct ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->tail++;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+reader(void *arg)
+{
+    struct pipeline *pl = arg;
+    struct block *b;
+    ssize_t n;
+
+    do {
+	b = ring_space(&pl->in);
+	if (b->buf == NULL && (b->buf = malloc(BLOCK_SIZE)) == NULL) {
+	    n = -1;
+	    errno = ENOMEM;
+	} else
+	    while ((n = read(pl->fd_in, b->buf, BLOCK_SIZE)) == -1 &&
+		errno == EINTR)
+		;
+	if (n == -1)
+	    pl->rerr = errno;
+	b->len = n > 0 ? n : 0;
+	ring_put(&pl->in);
+    } while (n > 0);
+    return (NULL);
+}
+
+static void *
+writer(void *arg)
+{
+    struct pipeline *pl = arg;
+    struct block *b;
+    char *p;
+    ssize_t n;
+
+    while ((b = ring_next(&pl->out))->len > 0) {
+	for (p = b->buf; pl->werr == 0 && p < b->buf + b->len; p += n)
+	    if ((n = write(pl->fd_out, p, b->buf + b->len - p)) == -1) {
+		if (errno == EINTR)
+		    n = 0;
+		else
+		    pl->werr = errno;	/* and drop the rest */
+	    }
+	ring_done(&pl->out);
+    }
+    return (NULL);
+}
+
+/*
+ * Called by fill_block for the next block of input, in place of read.
+ * The block before it is given back to the reader first, as fill_buffer
+ * has copied what it needed from it.  Returns the length of the block, or
+ * -1 if there is no reader.
+ */
+ssize_t
+pipe_fill(struct indent_ctx *ctx)
+{
+    struct pipeline *pl = ctx->pl;
+    struct block *b;
+
+    if (!pl->reading)
+	return (-1);
+    if (pl->eof)
+	return (0);
+    if (pl->held)
+	ring_done(&pl->in);
+    b = ring_next(&pl->in);
+    pl->held = 1;
+    if (b->len == 0) {
+	pl->eof = 1;
+	if (pl->rerr != 0) {
+	    errno = pl->rerr;
+	    err(1, "read");
+	}
+    }
+    rd_ptr = b->buf;
+    rd_end = b->buf + b->len;
+    return (b->len);
+}
+
+/*
+ * Called by out_flush to write what is buffered, in place of write.  The
+ * output buffer is handed to the writer as it is, and the next free block
+ * becomes the output buffer.  Returns 0 if there is no writer.
+ */
+int
+pipe_flush(struct indent_ctx *ctx)
+{
+    struct pipeline *pl = ctx->pl;
+    struct block *b = &pl->out.b[pl->out.head % RING_SIZE];
+
+    if (!pl->writing)
+	return (0);
+    if (out_ptr == out_buf)
+	return (1);
+    b->buf = out_buf;
+    b->len = out_ptr - out_buf;
+    b->size = out_limit - out_buf;
+    ring_put(&pl->out);
+    b = ring_space(&pl->out);
+    out_buf = out_ptr = b->buf;
+    out_limit = b->buf + b->size;
+    return (1);
+}
+
+int
+indent_pipe(struct indent_ctx *ctx, int infd, int outfd)
+{
+    struct pipeline pl;
+    struct stat st;
+    struct block *b;
+    int status;
+
+    memset(&pl, 0, sizeof pl);
+    ring_init(&pl.in);
+    ring_init(&pl.out);
+    pl.fd_in = infd;
+    pl.fd_out = outfd;
+    if (fstat(infd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	pl.reading = pthread_create(&pl.rtid, NULL, reader, &pl) == 0;
+    pl.writing = pthread_create(&pl.wtid, NULL, writer, &pl) == 0;
+
+    in_fd = infd;
+    out_fd = outfd;
+    ctx->pl = &pl;
+    status = indent_format(ctx);
+    ctx->pl = NULL;
+
+    /* the block at head is the output buffer, which the context keeps */
+    b = &pl.out.b[pl.out.head % RING_SIZE];
+    b->buf = NULL;
+    if (pl.writing) {
+	b->len = 0;
+	ring_put(&pl.out);
+	pthread_join(pl.wtid, NULL);
+    }
+    if (pl.reading) {
+	while (!pl.eof)		/* not if formatting stopped early */
+	    pipe_fill(ctx);
+	pthread_join(pl.rtid, NULL);
+    }
+    ring_free(&pl.in);
+    ring_free(&pl.out);
+    rd_ptr = rd_end = rd_buf;
+    in_fd = STDIN_FILENO;
+    out_fd = STDOUT_FILENO;
+    if (pl.werr != 0) {
+	errno = pl.werr;
+	err(1, "write");
+    }
+    return (status);
+}
@@ -35,6 +35,7 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "indent_globs.h"
 
 /*
@@ -69,7 +70,7 @@
  */
 
 void
-pr_comment(void)
+pr_comment(struct indent_ctx *ctx)
 {
     int         now_col;	/* column we are in now */
     int         adj_max_col;	/* Adjusted max_col for when we decide to
@@ -77,6 +78,7 @@ pr_comment(void)
     char       *last_bl;	/* points to the last blank in the output
 				 * buffer */
     char       *t_ptr;		/* used for moving string */
+    char       *run_end;	/* limit on a run of characters to copy */
     int         unix_comment;	/* tri-state variable used to decide if it is
 				 * a unix-style comment. 0 means only blanks
 				 * since / *, 1 means regular style comment, 2
@@ -121,11 +123,11 @@ pr_comment(void)
 	int    target_col;
 	break_delim = 0;
         if (s_code != e_code)
-	    target_col = count_spaces(compute_code_target(), s_code);
+	    target_col = count_spaces(compute_code_target(ctx), s_code);
 	else {
 	    target_col = 1;
 	    if (s_lab != e_lab)
-		target_col = count_spaces(compute_label_target(), s_lab);
+		target_col = count_spaces(compute_label_target(ctx), s_lab);
 	}
 
 	ps.com_col = ps.decl_on_line || ps.ind_level == 0 ? ps.decl_com_ind : ps.com_ind;
@@ -137,9 +139,11 @@ pr_comment(void)
     }
 
     if (ps.box_com) {
-	buf_ptr[-2] = 0;
-	ps.n_comment_delta = 1 - count_spaces(1, in_buffer);
-	buf_ptr[-2] = '/';
+	if (bp_save != 0)	/* comment came from save_com, its input
+				 * column is lost */
+	    ps.n_comment_delta = 0;
+	else
+	    ps.n_comment_delta = 1 - count_spaces_until(1, in_line, buf_ptr - 2);
     }
     else {
 	ps.n_comment_delta = 0;
@@ -164,13 +168,19 @@ pr_comment(void)
 				 * copied */
 	if (*buf_ptr > 040 && *buf_ptr != '*')
 	    ps.last_nl = 0;
-	CHECK_SIZE_COM;
+	if (e_com >= l_com) {
+	    int bl = last_bl != NULL ? last_bl - combuf : -1;
+
+	    grow_buf(&ctx->com, 1);
+	    if (bl >= 0)	/* last_bl must follow the buffer */
+		last_bl = combuf + bl;
+	}
 	switch (*buf_ptr) {	/* this checks for various spcl cases */
 	case 014:		/* check for a form feed */
 	    if (!ps.box_com) {	/* in a text comment, break the line here */
 		ps.use_ff = true;
 		/* fix so dump_line uses a form feed */
-		dump_line();
+		dump_line(ctx);
 		last_bl = 0;
 		*e_com++ = ' ';
 		*e_com++ = '*';
@@ -179,16 +189,19 @@ pr_comment(void)
 	    }
 	    else {
 		if (++buf_ptr >= buf_end)
-		    fill_buffer();
+		    fill_buffer(ctx);
 		*e_com++ = 014;
 	    }
 	    break;
 
 	case '\n':
 	    if (had_eof) {	/* check for unexpected eof */
-		printf("Unterminated comment\n");
+		static const char msg[] = "Unterminated comment\n";
+
+		if (!range_off)
+		    out_write(ctx, msg, sizeof msg - 1);
 		*e_com = '\0';
-		dump_line();
+		dump_line(ctx);
 		return;
 	    }
 	    one_liner = 0;
@@ -207,16 +220,16 @@ pr_comment(void)
 			break_delim = 2;
 			e_com = s_com + 2;
 			*e_com = 0;
-			dump_line();
+			dump_line(ctx);
 			e_com = t;
 			s_com[0] = s_com[1] = s_com[2] = ' ';
 		    }
-		    dump_line();
+		    dump_line(ctx);
 		    CHECK_SIZE_COM;
 		    *e_com++ = ' ';
 		    *e_com++ = ' ';
 		}
-		dump_line();
+		dump_line(ctx);
 		now_col = ps.com_col;
 	    }
 	    else {
@@ -235,7 +248,7 @@ pr_comment(void)
 		    }
 		    unix_comment = 2;	/* permanently remember that we are in
 					 * this type of comment */
-		    dump_line();
+		    dump_line(ctx);
 		    ++line_no;
 		    now_col = ps.com_col;
 		    *e_com++ = ' ';
@@ -245,7 +258,7 @@ pr_comment(void)
 		     */
 		    do		/* flush leading white space */
 			if (++buf_ptr >= buf_end)
-			    fill_buffer();
+			    fill_buffer(ctx);
 		    while (*buf_ptr == ' ' || *buf_ptr == '\t');
 		    break;
 		}
@@ -268,23 +281,23 @@ pr_comment(void)
 		do {		/* flush any blanks and/or tabs at start of
 				 * next line */
 		    if (++buf_ptr >= buf_end)
-			fill_buffer();
+			fill_buffer(ctx);
 		    if (*buf_ptr == '*' && --nstar >= 0) {
 			if (++buf_ptr >= buf_end)
-			    fill_buffer();
+			    fill_buffer(ctx);
 			if (*buf_ptr == '/')
 			    goto end_of_comment;
 		    }
 		} while (*buf_ptr == ' ' || *buf_ptr == '\t');
 	    }
 	    else if (++buf_ptr >= buf_end)
-		fill_buffer();
+		fill_buffer(ctx);
 	    break;		/* end of case for newline */
 
 	case '*':		/* must check for possibility of being at end
 				 * of comment */
 	    if (++buf_ptr >= buf_end)	/* get to next char after * */
-		fill_buffer();
+		fill_buffer(ctx);
 
 	    if (unix_comment == 0)	/* set flag to show we are not in
 					 * unix-style comment */
@@ -293,7 +306,7 @@ pr_comment(void)
 	    if (*buf_ptr == '/') {	/* it is the end!!! */
 	end_of_comment:
 		if (++buf_ptr >= buf_end)
-		    fill_buffer();
+		    fill_buffer(ctx);
 
 		if (*(e_com - 1) != ' ' && !ps.box_com) {	/* insure blank before
 								 * end */
@@ -306,14 +319,14 @@ pr_comment(void)
 		    break_delim = 2;
 		    e_com = s_com + 2;
 		    *e_com = 0;
-		    dump_line();
+		    dump_line(ctx);
 		    e_com = t;
 		    s_com[0] = s_com[1] = s_com[2] = ' ';
 		}
 		if (break_delim == 2 && e_com > s_com + 3
 			 /* now_col > adj_max_col - 2 && !ps.box_com */ ) {
 		    *e_com = '\0';
-		    dump_line();
+		    dump_line(ctx);
 		    now_col = ps.com_col;
 		}
 		CHECK_SIZE_COM;
@@ -329,12 +342,51 @@ pr_comment(void)
 	    }
 	    break;
 	default:		/* we have a random char */
+	    /*
+	     * Copy a run of ordinary characters at once, as long as it cannot
+	     * take the comment past the right margin.  Whatever ends the run
+	     * goes through this loop again.
+	     */
+	    t_ptr = buf_ptr;
+	    run_end = buf_end;
+	    if (run_end - t_ptr > adj_max_col - now_col)
+		run_end = t_ptr + (adj_max_col - now_col);
+	    if (run_end - t_ptr > l_com - e_com) {
+		int bl = last_bl != NULL ? last_bl - combuf : -1;
+
+		grow_buf(&ctx->com, run_end - t_ptr);
+		if (bl >= 0)
+		    last_bl = combuf + bl;
+	    }
+	    for (; t_ptr < run_end; t_ptr++) {
+		if (*t_ptr == '*' || *t_ptr == '\n' || *t_ptr == '\t' ||
+		    *t_ptr == '\b' || *t_ptr == 014)
+		    break;
+		if (*t_ptr == ' ')
+		    last_bl = e_com + (t_ptr - buf_ptr);
+		else {
+		    if (unix_comment == 0)
+			unix_comment = 1;
+		    if (*t_ptr > 040)
+			ps.last_nl = 0;
+		}
+	    }
+	    if (t_ptr - buf_ptr > 1) {
+		memcpy(e_com, buf_ptr, t_ptr - buf_ptr);
+		e_com += t_ptr - buf_ptr;
+		now_col += t_ptr - buf_ptr;
+		buf_ptr = t_ptr;
+		if (buf_ptr >= buf_end)
+		    fill_buffer(ctx);
+		break;
+	    }
+
 	    if (unix_comment == 0 && *buf_ptr != ' ' && *buf_ptr != '\t')
 		unix_comment = 1;	/* we are not in unix-style comment */
 
 	    *e_com = *buf_ptr++;
 	    if (buf_ptr >= buf_end)
-		fill_buffer();
+		fill_buffer(ctx);
 
 	    if (*e_com == '\t')	/* keep track of column */
 		now_col = ((now_col - 1) & tabmask) + tabsize + 1;
@@ -358,7 +410,7 @@ pr_comment(void)
 		    break_delim = 2;
 		    e_com = s_com + 2;
 		    *e_com = 0;
-		    dump_line();
+		    dump_line(ctx);
 		    e_com = t;
 		    s_com[0] = s_com[1] = s_com[2] = ' ';
 		}
@@ -371,7 +423,7 @@ pr_comment(void)
 		while (last_bl > s_com && last_bl[-1] < 040)
 		    *--last_bl = 0;
 		e_com = last_bl;
-		dump_line();
+		dump_line(ctx);
 
 		*e_com++ = ' ';	/* add blanks for continuation */
 		*e_com++ = ' ';
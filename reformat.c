@@ -0,0 +1,405 @@
+/*
+ * Format an input again after an edit without formatting all of it.
+ *
+ * While formatting, a checkpoint is taken at each line that starts at the
+ * top level: the parser stack is empty, no parens or braces are open and
+ * nothing is waiting in the buffers.  A checkpoint holds the state there
+ * and the input and output offsets.  When an edited version of the input
+ * comes in, formatting picks up from the last checkpoint before the first
+ * changed byte.  Once past the last changed byte, each checkpoint is
+ * compared with the one at the same place in the old input; when the
+ * state is the same again, the rest of the output must be the same too, so
+ * it is taken from the old output and formatting stops there.
+ *
+ * Formatting an input in parallel (see parallel.c) joins the runs over its
+ * chunks the same way.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "indent_globs.h"
+
+struct checkpoint {
+    size_t      in_off;		/* input offset of the line after it */
+    size_t      line_end;	/* ... and of its end: it has been read */
+    size_t      out_off;	/* bytes of output before it */
+    size_t      ndiags;		/* diagnostics before it */
+    int         refs;		/* line numbers in the output before it */
+    int         lineno;		/* line_no there */
+    int         inlineno;	/* in_lineno there */
+    struct fmt_state st;
+    struct parser_state pst;	/* with stacks of its own */
+};
+
+struct reformat {
+    char       *in;		/* the input last formatted */
+    size_t      inlen;
+    char       *out;		/* ... its output */
+    size_t      outlen;
+    struct indent_diag *diags;	/* ... its diagnostics */
+    size_t      ndiags;
+    int         refs;
+    struct checkpoint *ck;	/* ... and its checkpoints, in input order */
+    size_t      nck;
+
+    /* while formatting the new input */
+    const char *base;		/* the new input */
+    struct checkpoint *next;	/* its checkpoints */
+    size_t      nnext;
+    size_t      maxnext;
+    struct checkpoint *resume;	/* where to start, or NULL */
+    size_t      same;		/* the new input from here on ... */
+    size_t      old_same;	/* ... is the old input from here on */
+};
+
+static struct checkpoint *
+new_ckpt(struct reformat *rf)
+{
+    struct checkpoint *c;
+
+    if (rf->nnext >= rf->maxnext) {
+	size_t nmax = rf->maxnext ? rf->maxnext * 2 : 64;
+
+	c = reallocarray(rf->next, nmax, sizeof rf->next[0]);
+	if (c == NULL)
+	    err(1, NULL);
+	rf->next = c;
+	rf->maxnext = nmax;
+    }
+    c = &rf->next[rf->nnext++];
+    memset(c, 0, sizeof *c);
+    return (c);
+}
+
+static void
+copy_diag(struct indent_ctx *ctx, const struct indent_diag *from, int dline)
+{
+    struct indent_diag *d;
+
+    d = new_diag(ctx);
+    d->line = from->line + dline;
+    d->level = from->level;
+    if ((d->msg = strdup(from->msg)) == NULL)
+	err(1, NULL);
+    if (d->level)
+	found_err = 1;
+}
+
+/*
+ * The old checkpoint at input offset off, if there is one.
+ */
+static struct checkpoint *
+find_ckpt(struct reformat *rf, size_t off)
+{
+    size_t lo = 0, hi = rf->nck, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (rf->ck[mid].in_off < off)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return (lo < rf->nck && rf->ck[lo].in_off == off ? &rf->ck[lo] : NULL);
+}
+
+/*
+ * Whether the state is the same as at the checkpoint, at a line as long.
+ */
+static int
+same_state(struct indent_ctx *ctx, const struct checkpoint *old)
+{
+    return (old->line_end - old->in_off == (size_t)(buf_end - buf_ptr) &&
+	ps_same(&ps, &old->pst) &&
+	memcmp(&ctx->st, &old->st, sizeof ctx->st) == 0);
+}
+
+/*
+ * Go on from checkpoint c, with the input it was taken in at base, and
+ * line numbers dline further on.
+ */
+static void
+restore(struct indent_ctx *ctx, const struct checkpoint *c, const char *base,
+    int dline)
+{
+    ps_copy(&ps, &c->pst);
+    ctx->st = c->st;
+    line_no = c->lineno + dline;
+    in_lineno = c->inlineno + dline;
+    buf_ptr = in_line = (char *)base + c->in_off;
+    buf_end = map_ptr = (char *)base + c->line_end;
+}
+
+/*
+ * Restore the state from the checkpoint to resume at, along with the output
+ * and diagnostics before it.  Returns 0 if there is none, and formatting
+ * starts at the beginning.
+ */
+int
+ckpt_resume(struct indent_ctx *ctx)
+{
+    struct reformat *rf = ctx->rf;
+    struct checkpoint *c = rf->resume;
+    size_t i;
+
+    if (c == NULL)
+	return (0);
+    restore(ctx, c, rf->base, 0);
+    line_refs = c->refs;
+    for (i = 0; i < c->ndiags; i++)
+	copy_diag(ctx, &rf->diags[i], 0);
+    out_write(ctx, rf->out, c->out_off);
+    return (1);
+}
+
+/*
+ * Whether this is the start of a line at the top level, where checkpoints
+ * are taken.
+ */
+int
+ckpt_top(struct indent_ctx *ctx)
+{
+    return (ps.tos == 0 && ps.p_l_follow == 0 && ps.paren_level == 0 &&
+	ps.dec_nest == 0 && !ps.search_brace && bp_save == 0 && sc_end == 0 &&
+	ifdef_level == 0 && !inhibit_formatting && !had_eof &&
+	s_code == e_code && s_lab == e_lab && s_com == e_com &&
+	buf_ptr == in_line && buf_end == map_ptr);
+}
+
+/*
+ * Called at the start of each line.  Take a checkpoint if this is the top
+ * level.  Returns 1 if the state is the same as at the same place in the
+ * old input, after the output and diagnostics from there on have been
+ * taken over; the caller stops formatting then.
+ */
+int
+ckpt_take(struct indent_ctx *ctx)
+{
+    struct reformat *rf = ctx->rf;
+    struct checkpoint *c, *old;
+    size_t off, end, i;
+    int dline;
+
+    if (!ckpt_top(ctx))
+	return (0);	/* not at the top level, or not at a whole line */
+    off = buf_ptr - rf->base;
+    end = buf_end - rf->base;
+
+    if (rf->in != NULL && off >= rf->same &&
+	(old = find_ckpt(rf, off - rf->same + rf->old_same)) != NULL &&
+	same_state(ctx, old) &&
+	(line_no == old->lineno || old->refs == rf->refs)) {
+	/*
+	 * Converged.  The old output cannot be used if it quotes line
+	 * numbers that the edit has moved.
+	 */
+	dline = line_no - old->lineno;
+	for (c = old; c < rf->ck + rf->nck; c++) {
+	    struct checkpoint *n = new_ckpt(rf);
+
+	    *n = *c;	/* the stacks move over too */
+	    memset(&c->pst, 0, sizeof c->pst);
+	    n->in_off = c->in_off - old->in_off + off;
+	    n->line_end = c->line_end - old->in_off + off;
+	    n->out_off = c->out_off - old->out_off + (out_ptr - out_buf);
+	    n->ndiags = c->ndiags - old->ndiags + diag_cnt;
+	    n->refs = c->refs - old->refs + line_refs;
+	    n->lineno = c->lineno + dline;
+	    n->inlineno = c->inlineno - old->inlineno + in_lineno;
+	}
+	out_write(ctx, rf->out + old->out_off, rf->outlen - old->out_off);
+	for (i = old->ndiags; i < rf->ndiags; i++)
+	    copy_diag(ctx, &rf->diags[i], dline);
+	line_refs += rf->refs - old->refs;
+	return (1);
+    }
+
+    c = new_ckpt(rf);
+    c->in_off = off;
+    c->line_end = end;
+    c->out_off = out_ptr - out_buf;
+    c->ndiags = diag_cnt;
+    c->refs = line_refs;
+    c->lineno = line_no;
+    c->inlineno = in_lineno;
+    c->st = ctx->st;
+    ps_copy(&c->pst, &ps);
+    return (0);
+}
+
+/*
+ * Join the run of rf over a piece of a larger input, at offset off into
+ * the piece, which starts at base in the input.  If the state is the same
+ * as at rf's checkpoint there, take over rf's output and diagnostics from
+ * there up to its last checkpoint, and go on from that checkpoint; or take
+ * over all the rest of them if last is set.  The output past the last
+ * checkpoint may have been made knowing where the piece ends, so only the
+ * last piece of an input can give it.  Returns 1 if joined.
+ */
+int
+ckpt_join(struct indent_ctx *ctx, struct reformat *rf, const char *base,
+    size_t off, int last)
+{
+    struct checkpoint *old, *to;
+    size_t outlen, ndiags, i;
+    int refs, dline;
+
+    if ((old = find_ckpt(rf, off)) == NULL || !same_state(ctx, old))
+	return (0);
+    to = &rf->ck[rf->nck - 1];
+    outlen = last ? rf->outlen : to->out_off;
+    ndiags = last ? rf->ndiags : to->ndiags;
+    refs = last ? rf->refs : to->refs;
+    dline = line_no - old->lineno;
+    if (dline != 0 && refs != old->refs)
+	return (0);	/* its output quotes its own line numbers */
+
+    out_write(ctx, rf->out + old->out_off, outlen - old->out_off);
+    for (i = old->ndiags; i < ndiags; i++)
+	copy_diag(ctx, &rf->diags[i], dline);
+    line_refs += refs - old->refs;
+    if (!last)
+	restore(ctx, to, base, dline);
+    return (1);
+}
+
+/*
+ * Forget the last input and its checkpoints.
+ */
+static void
+forget(struct reformat *rf)
+{
+    size_t i;
+
+    for (i = 0; i < rf->nck; i++)
+	ps_free(&rf->ck[i].pst);
+    free(rf->ck);
+    for (i = 0; i < rf->ndiags; i++)
+	free(rf->diags[i].msg);
+    free(rf->diags);
+    free(rf->in);
+    free(rf->out);
+    rf->ck = NULL;
+    rf->diags = NULL;
+    rf->in = rf->out = NULL;
+    rf->nck = rf->ndiags = rf->inlen = rf->outlen = 0;
+    rf->refs = 0;
+}
+
+void
+reformat_free(struct indent_ctx *ctx)
+{
+    struct reformat *rf = ctx->rf;
+    size_t i;
+
+    if (rf == NULL)
+	return;
+    forget(rf);
+    for (i = 0; i < rf->nnext; i++)
+	ps_free(&rf->next[i].pst);
+    free(rf->next);
+    free(rf);
+    ctx->rf = NULL;
+}
+
+/*
+ * Copy res into the history, to compare the next input with.
+ */
+static void
+remember(struct reformat *rf, const char *in, size_t len,
+    const struct indent_result *res, int refs)
+{
+    size_t i;
+
+    if ((rf->in = malloc(len ? len : 1)) == NULL ||
+	(rf->out = malloc(res->outlen ? res->outlen : 1)) == NULL ||
+	(rf->diags = calloc(res->ndiags ? res->ndiags : 1,
+	sizeof rf->diags[0])) == NULL)
+	err(1, NULL);
+    memcpy(rf->in, in, len);
+    rf->inlen = len;
+    memcpy(rf->out, res->out, res->outlen);
+    rf->outlen = res->outlen;
+    for (i = 0; i < res->ndiags; i++) {
+	rf->diags[i] = res->diags[i];
+	if ((rf->diags[i].msg = strdup(res->diags[i].msg)) == NULL)
+	    err(1, NULL);
+    }
+    rf->ndiags = res->ndiags;
+    rf->refs = refs;
+}
+
+int
+indent_reformat(struct indent_ctx *ctx, const char *in, size_t len,
+    struct indent_result *res)
+{
+    struct reformat *rf;
+    size_t pre, suf, max, i;
+
+    if (in == NULL)
+	in = "";
+    if ((rf = ctx->rf) == NULL && (rf = ctx->rf = calloc(1, sizeof *rf)) == NULL)
+	err(1, NULL);
+    if (nranges > 0) {		/* the output depends on more than the input */
+	forget(rf);
+	return (indent_buffer(ctx, in, len, res));
+    }
+
+    if (rf->in != NULL && rf->inlen == len && memcmp(rf->in, in, len) == 0) {
+	/* nothing changed */
+	memset(res, 0, sizeof *res);
+	if ((res->out = malloc(rf->outlen + 1)) == NULL ||
+	    (res->diags = calloc(rf->ndiags ? rf->ndiags : 1,
+	    sizeof res->diags[0])) == NULL)
+	    err(1, NULL);
+	memcpy(res->out, rf->out, rf->outlen);
+	res->out[rf->outlen] = '\0';
+	res->outlen = rf->outlen;
+	for (i = 0; i < rf->ndiags; i++) {
+	    res->diags[i] = rf->diags[i];
+	    if ((res->diags[i].msg = strdup(rf->diags[i].msg)) == NULL)
+		err(1, NULL);
+	    if (res->diags[i].level)
+		res->status = 1;
+	}
+	res->ndiags = rf->ndiags;
+	return (res->status);
+    }
+
+    rf->nnext = 0;
+    rf->resume = NULL;
+    if (rf->in != NULL) {
+	max = len < rf->inlen ? len : rf->inlen;
+	for (pre = 0; pre < max && in[pre] == rf->in[pre]; pre++)
+	    ;
+	for (suf = 0; suf < max - pre &&
+	    in[len - 1 - suf] == rf->in[rf->inlen - 1 - suf]; suf++)
+	    ;
+	rf->same = len - suf;
+	rf->old_same = rf->inlen - suf;
+
+	/* the checkpoints before the first change still hold */
+	for (i = 0; i < rf->nck && rf->ck[i].line_end <= pre; i++) {
+	    *new_ckpt(rf) = rf->ck[i];
+	    memset(&rf->ck[i].pst, 0, sizeof rf->ck[i].pst);
+	}
+	if (i > 0)
+	    rf->resume = &rf->next[i - 1];
+    }
+
+    rf->base = in;
+    ckpt_on = 1;
+    indent_buffer(ctx, in, len, res);
+    ckpt_on = 0;
+
+    /* the new checkpoints replace the old ones */
+    forget(rf);
+    rf->ck = rf->next;
+    rf->nck = rf->nnext;
+    rf->next = NULL;
+    rf->nnext = rf->maxnext = 0;
+    rf->resume = NULL;
+    remember(rf, in, len, res, line_refs);
+    return (res->status);
+}
@@ -0,0 +1,3 @@
+int x = (((((((((((((((((((((((((((((((((((((((((int)-a))))))))))))))))))))))))))))))))))))))));
+int y = ((((((((((((((((((((((((((((((((((((((((sizeof(long)))))))))))))))))))))))))))))))))))))))));
+int z = ((int)-b);
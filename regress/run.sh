@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Format each regress/*.c on stdin, through a pipe so that it is read in
+# blocks and not mapped, and compare the result with the .out next to it.
+# Formatting a range of all the lines must give the same result too.
+#
+# usage: run.sh indent
+
+bin=${1:-./indent.out}
+dir=$(dirname "$0")
+fail=0
+for f in "$dir"/*.c; do
+	cat "$f" | "$bin" > "$f.res" 2>&1
+	if ! cmp -s "$f.res" "${f%.c}.out"; then
+		echo "FAIL: $f"
+		fail=1
+	fi
+	cat "$f" | "$bin" -r 1:$(wc -l < "$f") > "$f.res" 2>&1
+	if ! cmp -s "$f.res" "${f%.c}.out"; then
+		echo "FAIL: $f, as a range"
+		fail=1
+	fi
+	rm -f "$f.res"
+done
+exit $fail
@@ -0,0 +1,8 @@
+int a;
+
+int
+f()
+{
+	return (0);
+
+
@@ -0,0 +1,210 @@
+/*
+ * Serve format requests from a long running process, so a caller that
+ * formats over and over (an editor, a hook) pays for startup only once.
+ *
+ * A request is a 4 byte big endian length followed by that many bytes of
+ * source.  The response is a 4 byte big endian length, a 4 byte big endian
+ * status (non-zero if an error was diagnosed) and the formatted text, or in
+ * edit mode the list of edits that turn the source into it (see diff.c).
+ * A request longer than REQ_MAX, or one there is no memory for, is not
+ * answered: the connection is closed instead, and the server goes on with
+ * the next one.
+ * One context serves every request: the parser state is reset for each one by
+ * indent_format, and the buffers and keyword table stay allocated.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include "indent_globs.h"
+#include "diff.h"
+
+#define REQ_MAX	(64 * 1024 * 1024)	/* longest request served */
+
+/*
+ * Read exactly n bytes.  Returns 1 if they were read, 0 at end of file
+ * before the first byte, -1 on an error or at end of file after it.
+ */
+static int
+read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t r;
+
+    while (n > 0) {
+	r = read(fd, p, n);
+	if (r == -1 && errno == EINTR)
+	    continue;
+	if (r == -1) {
+	    warn("read");
+	    return (-1);
+	}
+	if (r == 0)
+	    return (p == (char *)buf ? 0 : -1);
+	p += r;
+	n -= r;
+    }
+    return (1);
+}
+
+static int
+write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    ssize_t r;
+
+    while (n > 0) {
+	r = write(fd, p, n);
+	if (r == -1 && errno == EINTR)
+	    continue;
+	if (r == -1)
+	    return (-1);
+	p += r;
+	n -= r;
+    }
+    return (0);
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * Serve requests read from infd until it reaches end of file.  Returns -1
+ * if a request is cut short or refused, or a response could not be
+ * written.
+ */
+static int
+serve_fd(struct indent_ctx *ctx, int infd, int outfd, int mode)
+{
+    unsigned char hdr[8];
+    char *req = NULL, *nreq, *out, *edits = NULL;
+    size_t reqsize = 0, len, outlen;
+    int r, status;
+
+    for (;;) {
+	if ((r = read_full(infd, hdr, 4)) == 0)
+	    break;
+	if (r == -1)
+	    goto bad;
+	len = (size_t)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+	if (len > REQ_MAX) {
+	    warnx("request too long");
+	    goto bad;
+	}
+	if (len > reqsize) {
+	    if ((nreq = realloc(req, len)) == NULL) {
+		warn(NULL);
+		goto bad;
+	    }
+	    req = nreq;
+	    reqsize = len;
+	}
+	if (len > 0 && read_full(infd, req, len) != 1)
+	    goto bad;
+
+	in_fd = -1;
+	map_ptr = req;
+	map_end = req + len;
+	out_fd = -1;
+	status = indent_format(ctx);
+	out = out_buf;
+	outlen = out_ptr - out_buf;
+	if (mode == INDENT_EDITS)
+	    out = edits = uedits(req, len, out_buf, outlen, &outlen);
+	if (outlen > UINT32_MAX) {
+	    warnx("response too long");
+	    goto bad;
+	}
+	put32(hdr, outlen);
+	put32(hdr + 4, status);
+	if (write_full(outfd, hdr, 8) == -1 ||
+	    write_full(outfd, out, outlen) == -1) {
+	    warn("write");
+	    goto bad;
+	}
+	out_ptr = out_buf;
+	free(edits);
+	edits = NULL;
+    }
+    free(req);
+    return (0);
+bad:
+    out_ptr = out_buf;
+    free(edits);
+    free(req);
+    return (-1);
+}
+
+int
+indent_serve(struct indent_ctx *ctx, int infd, int outfd, int mode)
+{
+    int ret;
+
+    ret = serve_fd(ctx, infd, outfd, mode);
+    in_fd = STDIN_FILENO;
+    out_fd = STDOUT_FILENO;
+    return (ret);
+}
+
+/*
+ * Listen on the unix socket at path and serve one connection at a time.
+ * A client that goes away only ends its own connection.  Only returns if
+ * the socket cannot be set up.
+ */
+int
+indent_serve_socket(struct indent_ctx *ctx, const char *path, int mode)
+{
+    struct sockaddr_un sun;
+    struct stat st;
+    int s, fd;
+
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    if (strlcpy(sun.sun_path, path, sizeof sun.sun_path) >=
+	sizeof sun.sun_path) {
+	errno = ENAMETOOLONG;
+	return (-1);
+    }
+    /* a socket left from an earlier run is replaced, anything else kept */
+    if (lstat(path, &st) == 0) {
+	if (!S_ISSOCK(st.st_mode)) {
+	    errno = EEXIST;
+	    return (-1);
+	}
+	if (unlink(path) == -1)
+	    return (-1);
+    } else if (errno != ENOENT)
+	return (-1);
+    signal(SIGPIPE, SIG_IGN);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	return (-1);
+    if (bind(s, (struct sockaddr *)&sun, sizeof sun) == -1 ||
+	listen(s, 16) == -1) {
+	close(s);
+	return (-1);
+    }
+    for (;;) {
+	if ((fd = accept(s, NULL, NULL)) == -1) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    close(s);
+	    return (-1);
+	}
+	indent_serve(ctx, fd, fd, mode);
+	close(fd);
+    }
+}
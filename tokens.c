@@ -0,0 +1,154 @@
+/*
+ * A pass over the whole input, before formatting it, that finds the names,
+ * numbers and literals in it and keeps them in a flat token stream: where
+ * each starts, how long it is, what kind it is, its line and whether it
+ * starts the line, in separate arrays so that lexi walks through them in
+ * order.  The line is that of the input, counting every newline, and not
+ * line_no, which comments and their reflowing move about.
+ *
+ * What lexi makes of a token depends on the parser state (a name can be a
+ * declaration or not, a '-' unary or binary), so the stream cannot say
+ * that, and lexi still decides it for every token as it comes.  What does
+ * not depend on the state is where a name or a literal ends and whether a
+ * name is a keyword, and lexi takes these from the stream instead of
+ * scanning the bytes again.  The pass does not know where comments and
+ * preprocessor lines are for sure either, so the stream may hold tokens
+ * lexi never asks for; a token is only used when lexi is at the very byte
+ * it starts at, and then it is right whatever came before.
+ *
+ * The pass costs about what lexi saves by it, so a stream is only made when
+ * indent_set_tokens asks for one; nothing else makes one, and no run
+ * that has not asked pays for it.  A stream only reads the input, so one
+ * made for a large input is shared by the contexts formatting pieces of it
+ * (see parallel.c).  A stream is allocated from an arena, and is gone when
+ * the arena is reset.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+#include "indent_globs.h"
+
+/* as lexi has it, but not past ASCII */
+#define NAME(c)	((unsigned char)(c) < 128 && chartype[(unsigned char)(c)] == 1)
+
+static void
+add(struct arena *a, struct tokens *t, size_t off, size_t len, int kind,
+    size_t line, int col_1)
+{
+    size_t size;
+
+    if (t->n == t->size) {
+	size = t->size ? t->size * 2 : 1024;
+	if ((t->off = arena_grow(a, t->off, t->size * sizeof t->off[0],
+	    size * sizeof t->off[0])) == NULL ||
+	    (t->len = arena_grow(a, t->len, t->size * sizeof t->len[0],
+	    size * sizeof t->len[0])) == NULL ||
+	    (t->line = arena_grow(a, t->line, t->size * sizeof t->line[0],
+	    size * sizeof t->line[0])) == NULL ||
+	    (t->kind = arena_grow(a, t->kind, t->size * sizeof t->kind[0],
+	    size * sizeof t->kind[0])) == NULL ||
+	    (t->col_1 = arena_grow(a, t->col_1, t->size * sizeof t->col_1[0],
+	    size * sizeof t->col_1[0])) == NULL)
+	    err(1, NULL);
+	t->size = size;
+    }
+    t->off[t->n] = off;
+    t->len[t->n] = len;
+    t->line[t->n] = line;
+    t->kind[t->n] = kind;
+    t->col_1[t->n++] = col_1;
+}
+
+/*
+ * Make the stream for the len bytes at in, from a, or return NULL if it is
+ * not worth it.  Only whole lines are looked at, as the last line is copied
+ * by fill_buffer if it has no newline.
+ */
+struct tokens *
+tok_scan(struct indent_ctx *ctx, struct arena *a, const char *in, size_t len)
+{
+    struct tokens *t;
+    const char *p, *q, *end;
+    size_t n, line = 1;
+    int c;
+
+    for (end = in + len; end > in && end[-1] != '\n'; end--)
+	;
+    if (len > UINT32_MAX || end == in)
+	return (NULL);
+    if ((t = arena_alloc(a, sizeof *t)) == NULL)
+	err(1, NULL);
+    memset(t, 0, sizeof *t);
+    t->base = in;
+    t->end = end;
+    for (p = in; p < end;) {
+	c = *p;
+	if (c == '#' && (p == in || p[-1] == '\n')) {
+	    /* the rest of a preprocessor line is copied as it is */
+	    for (p++; p < end && *p != '\n'; p++)
+		if (*p == BACKSLASH && p[1] == '\n') {
+		    p++;
+		    line++;
+		}
+	} else if (NAME(c) || (c == '.' && isdigit((unsigned char)p[1]))) {
+	    n = scan_name(p);
+	    if ((unsigned char)p[n] < 128)	/* lexi is not sure past it */
+		add(a, t, p - in, n, keyword(ctx, p, n), line,
+		    p == in || p[-1] == '\n');
+	    p += n;
+	} else if (c == '"' || c == '\'') {
+	    if ((n = scan_literal(p, end)) != 0)
+		add(a, t, p - in, n, TOK_LIT, line, p == in || p[-1] == '\n');
+	    for (q = p, p += n ? n : 1; q < p; q++)
+		if (*q == '\n')	/* escaped */
+		    line++;
+	} else if (c == '/' && p[1] == '*') {
+	    for (p += 2; p < end - 1 && !(p[0] == '*' && p[1] == '/'); p++)
+		if (*p == '\n')
+		    line++;
+	    p += 2;
+	} else if (*p++ == '\n')
+	    line++;
+    }
+    return (t);
+}
+
+/*
+ * Find the token that starts at p in the stream of ctx.  Returns its
+ * index, or -1 if there is none.  lexi mostly asks for the tokens in
+ * order, so the search starts with the ones after the last found.
+ */
+long
+tok_find(struct indent_ctx *ctx, const char *p)
+{
+    struct tokens *t = ctx->toks;
+    size_t off, lo, hi, mid;
+    int k;
+
+    if (p < t->base || p >= t->end)
+	return (-1);		/* in in_buffer or save_com */
+    off = p - t->base;
+    lo = ctx->tok_next;
+    if (lo > t->n || (lo > 0 && t->off[lo - 1] >= off))
+	lo = 0;			/* gone back */
+    hi = t->n;
+    for (k = 0; k < 8 && lo < hi; k++, lo++)
+	if (t->off[lo] >= off) {
+	    hi = lo;
+	    break;
+	}
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (t->off[mid] < off)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    ctx->tok_next = lo;
+    if (lo == t->n || t->off[lo] != off)
+	return (-1);
+    ctx->tok_next++;
+    return (lo);
+}